@@ -0,0 +1,310 @@
+/* analysis.h written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file defines the Analysis used by granular-resynth.cpp to resynthesize a sound file: it runs an STFT over a
+ * loaded Buffer, picks spectral peaks, tracks them from frame to frame, and fits an FM chirplet (GrainSettings) to
+ * every track: carrier glide from the track itself, modulator glide and modulation depth from its strongest
+ * sideband, envelope and gain from its amplitude. The source is streamed through in overlapping batches of frames,
+ * each batch's FFTs run in parallel on every core, and tracks are summarised as they grow, so memory stays bounded
+ * by the batch and the grains kept, however long the file.
+ * References: McAulay & Quatieri, "Speech Analysis/Synthesis Based on a Sinusoidal Representation" (1986)
+ */
+
+# pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <cstdio>
+#include <queue>
+#include <thread>
+#include <vector>
+#include "buffer.h"
+#include "grains.h"
+
+const int FFT_SIZE = 2048;
+const int HOP_SIZE = 512;
+const int MAX_PEAKS = 24; // strongest peaks kept per frame
+const int MIN_TRACK_FRAMES = 4; // shorter tracks are noise, not grains
+const int BATCH_FRAMES = 256; // STFT frames analyzed in parallel per chunk of the source
+
+// run f(begin, end) over [0, n) split into contiguous ranges, one per core
+template <class F> void parallelFor(int n, F f) {
+  const int threads = std::max(1, std::min(n, (int)std::thread::hardware_concurrency()));
+  std::vector<std::thread> pool;
+  for (int t = 1; t < threads; t++) pool.emplace_back(f, (long)n * t / threads, (long)n * (t + 1) / threads);
+  f(0, (long)n / threads);
+  for (auto& thread : pool) thread.join();
+}
+
+// iterative radix-2 FFT with precomputed twiddles and bit reversal
+struct FFT {
+  int n;
+  std::vector<std::complex<float>> twiddle;
+  std::vector<int> reversed;
+
+  FFT(int size) : n(size), twiddle(size / 2), reversed(size) {
+    for (int k = 0; k < n / 2; k++) twiddle[k] = std::polar(1.0f, (float)(-2 * M_PI * k / n));
+    int bits = 0;
+    while ((1 << bits) < n) bits++;
+    for (int i = 0; i < n; i++) {
+      int r = 0;
+      for (int b = 0; b < bits; b++) r |= ((i >> b) & 1) << (bits - 1 - b);
+      reversed[i] = r;
+    }
+  }
+
+  void operator()(std::complex<float>* x) const {
+    for (int i = 0; i < n; i++)
+      if (i < reversed[i]) std::swap(x[i], x[reversed[i]]);
+    for (int length = 2; length <= n; length <<= 1) {
+      const int half = length / 2, stride = n / length;
+      for (int i = 0; i < n; i += length)
+        for (int k = 0; k < half; k++) {
+          std::complex<float> t = twiddle[k * stride] * x[i + k + half];
+          x[i + k + half] = x[i + k] - t;
+          x[i + k] += t;
+        }
+    }
+  }
+};
+
+struct Peak {
+  float frequency; // Hz
+  float amplitude; // linear, 1 for a full scale sine
+};
+
+// modulator frequency and depth read off the strongest sideband next to a carrier peak
+struct Sideband {
+  bool found = false;
+  float modulator = 0, depth = 0;
+};
+
+// a peak track, summarised as it grows so the frames it came from can be dropped
+struct Track {
+  long start = 0; // first frame
+  int length = 0;
+  Peak first, last, loudest;
+  int loudestAt = 0;
+  float energy = 0;
+  Sideband atFirst, atLast, atLoudest;
+
+  bool operator>(const Track& t) const { return energy > t.energy; }
+};
+
+struct Analysis {
+  float sampleRate = SAMPLE_RATE;
+  std::vector<float> window;
+  FFT fft{FFT_SIZE};
+  std::vector<std::vector<Peak>> batch; // peaks of the frames being tracked
+  std::vector<Track> alive;
+  std::priority_queue<Track, std::vector<Track>, std::greater<Track>> kept; // the strongest finished tracks, weakest on top
+  int maxGrains = MAX_GRAINS;
+
+  Analysis() : window(FFT_SIZE) {
+    for (int i = 0; i < FFT_SIZE; i++) window[i] = 0.5f - 0.5f * cosf(2 * M_PI * i / FFT_SIZE); // Hann
+  }
+
+  // peaks of one windowed frame starting at sample offset, strongest first
+  void analyzeFrame(const float* samples, long size, long offset, std::complex<float>* x, std::vector<Peak>& peaks) const {
+    float windowSum = 0;
+    for (int i = 0; i < FFT_SIZE; i++) {
+      long j = offset + i;
+      x[i] = (j >= 0 && j < size) ? samples[j] * window[i] : 0.0f;
+      windowSum += window[i];
+    }
+    fft(x);
+
+    float magnitude[FFT_SIZE / 2 + 1];
+    float loudest = 0;
+    for (int k = 0; k <= FFT_SIZE / 2; k++) {
+      magnitude[k] = 2 * std::abs(x[k]) / windowSum;
+      loudest = std::max(loudest, magnitude[k]);
+    }
+    const float floor = std::max(loudest * 0.003f, 1e-4f); // -50 dB below the frame's peak, -80 dBFS absolute
+
+    peaks.clear();
+    for (int k = 1; k < FFT_SIZE / 2; k++) {
+      if (magnitude[k] < floor || magnitude[k] <= magnitude[k - 1] || magnitude[k] < magnitude[k + 1]) continue;
+      // parabolic interpolation on the log magnitude
+      float a = logf(magnitude[k - 1] + 1e-12f), b = logf(magnitude[k]), c = logf(magnitude[k + 1] + 1e-12f);
+      float d = a - 2 * b + c;
+      float p = (d != 0) ? 0.5f * (a - c) / d : 0;
+      peaks.push_back({(k + p) * sampleRate / FFT_SIZE, expf(b - 0.25f * (a - c) * p)});
+    }
+    std::sort(peaks.begin(), peaks.end(), [](const Peak& l, const Peak& r) { return l.amplitude > r.amplitude; });
+    if (peaks.size() > MAX_PEAKS) peaks.resize(MAX_PEAKS);
+  }
+
+  // the strongest weaker peak of a frame, read as the first sideband of an FM pair at this carrier
+  static Sideband sideband(const std::vector<Peak>& frame, const Peak& carrier) {
+    Sideband s;
+    float strongest = 0;
+    for (const Peak& p : frame) {
+      float spacing = fabsf(p.frequency - carrier.frequency);
+      if (spacing < 1 || spacing > carrier.frequency || p.amplitude >= carrier.amplitude || p.amplitude <= strongest) continue;
+      strongest = p.amplitude;
+      s.found = true;
+      s.modulator = spacing;
+      s.depth = std::min(2 * p.amplitude / carrier.amplitude, 10.0f) * spacing; // J1(I) / J0(I) is about I / 2 for small I
+    }
+    return s;
+  }
+
+  void finish(const Track& t) {
+    if (t.length < MIN_TRACK_FRAMES) return;
+    kept.push(t);
+    if (kept.size() > maxGrains) kept.pop();
+  }
+
+  // join one frame's peaks onto the nearest continuing track, within a semitone
+  void track(long f, const std::vector<Peak>& peaks) {
+    bool claimed[MAX_PEAKS] = {};
+    std::vector<Track> next;
+    for (Track& t : alive) {
+      int best = -1;
+      float bestDistance = 1.0f;
+      for (int p = 0; p < peaks.size(); p++) {
+        if (claimed[p]) continue;
+        float distance = fabsf(12 * log2f(peaks[p].frequency / t.last.frequency));
+        if (distance < bestDistance) {
+          bestDistance = distance;
+          best = p;
+        }
+      }
+      if (best < 0 || (long)t.length * HOP_SIZE >= MAX_DURATION * sampleRate) { // track ends
+        finish(t);
+        continue;
+      }
+      claimed[best] = true;
+      const Peak& p = peaks[best];
+      t.last = p;
+      t.atLast = sideband(peaks, p);
+      if (p.amplitude > t.loudest.amplitude) {
+        t.loudest = p;
+        t.loudestAt = t.length;
+        t.atLoudest = t.atLast;
+      }
+      t.energy += p.amplitude * p.amplitude;
+      t.length++;
+      next.push_back(t);
+    }
+    for (int p = 0; p < peaks.size(); p++) {
+      if (claimed[p]) continue;
+      Track t;
+      t.start = f;
+      t.length = 1;
+      t.first = t.last = t.loudest = peaks[p];
+      t.atFirst = t.atLast = t.atLoudest = sideband(peaks, peaks[p]);
+      t.energy = peaks[p].amplitude * peaks[p].amplitude;
+      next.push_back(t);
+    }
+    alive.swap(next);
+  }
+
+  // analyze frames [first, first + count) out of a chunk of samples starting at frame base of the source:
+  // FFTs in parallel, then tracking in order
+  void consume(const float* chunk, long base, long valid, long first, int count) {
+    batch.resize(count);
+    parallelFor(count, [&](long begin, long end) {
+      std::vector<std::complex<float>> x(FFT_SIZE);
+      for (long i = begin; i < end; i++) analyzeFrame(chunk, valid, (first + i) * HOP_SIZE - FFT_SIZE / 2 - base, x.data(), batch[i]);
+    });
+    for (int i = 0; i < count; i++) track(first + i, batch[i]);
+  }
+
+  void fit(const Track& t, float loudest, GrainSettings& g) const {
+    const float low = mtof(0), high = mtof(MAX_FREQUENCY);
+    g.onset = (float)t.start * HOP_SIZE / sampleRate;
+    g.duration = al::clip((float)t.length * HOP_SIZE / sampleRate, (float)MAX_DURATION, 0.01f);
+    g.envelope = al::clip((t.loudestAt + 0.5f) / t.length, 1.0f, 0.01f);
+    g.gain = t.loudest.amplitude / loudest;
+    g.carrier_start = al::clip(t.first.frequency, high, low);
+    g.carrier_end = al::clip(t.last.frequency, high, low);
+
+    Sideband middle = t.atLoudest;
+    if (!middle.found) { // a near-pure tone
+      middle.modulator = t.loudest.frequency;
+      middle.depth = 0.01f * middle.modulator;
+    }
+    const Sideband& first = t.atFirst.found ? t.atFirst : middle;
+    const Sideband& last = t.atLast.found ? t.atLast : middle;
+    g.modulator_start = al::clip(first.modulator, high, low);
+    g.modulator_end = al::clip(last.modulator, high, low);
+    g.md_start = al::clip(first.depth, high, 0.0f);
+    g.md_end = al::clip(last.depth, high, 0.0f);
+    g.modulator_depth = 0.5f * (g.md_start + g.md_end);
+    g.place();
+  }
+
+  // the kept tracks as grains, in the order they occur
+  std::vector<GrainSettings> grains() {
+    for (const Track& t : alive) finish(t);
+    alive.clear();
+    std::vector<Track> tracks;
+    for (; !kept.empty(); kept.pop()) tracks.push_back(kept.top());
+    std::sort(tracks.begin(), tracks.end(), [](const Track& l, const Track& r) { return l.start < r.start; });
+
+    float loudest = 1e-9f;
+    for (auto& t : tracks) loudest = std::max(loudest, t.loudest.amplitude);
+
+    std::vector<GrainSettings> grains(tracks.size());
+    parallelFor(tracks.size(), [&](long begin, long end) {
+      for (long i = begin; i < end; i++) fit(tracks[i], loudest, grains[i]);
+    });
+    return grains;
+  }
+
+  // the (at most) maxGrains strongest chirplets of samples already in memory (or mapped)
+  std::vector<GrainSettings> run(const float* samples, long size, int rate, int maxGrains) {
+    this->maxGrains = maxGrains;
+    sampleRate = rate;
+    const long frames = (size + HOP_SIZE - 1) / HOP_SIZE;
+    for (long f = 0; f < frames; f += BATCH_FRAMES) consume(samples, 0, size, f, std::min((long)BATCH_FRAMES, frames - f));
+    return grains();
+  }
+  std::vector<GrainSettings> run(const Buffer& buffer, int maxGrains) { return run(buffer.data(), buffer.size(), buffer.sampleRate, maxGrains); }
+
+  // the same, streamed from a file in overlapping chunks of BATCH_FRAMES frames
+  std::vector<GrainSettings> run(WavStream& stream, int maxGrains) {
+    this->maxGrains = maxGrains;
+    sampleRate = stream.sampleRate;
+    const long frames = (stream.frames + HOP_SIZE - 1) / HOP_SIZE;
+    long first = 0;
+    stream.chunks((BATCH_FRAMES - 1) * HOP_SIZE + FFT_SIZE, BATCH_FRAMES * HOP_SIZE, FFT_SIZE / 2, [&](const float* chunk, long base, long valid) {
+      int count = std::min((long)BATCH_FRAMES, frames - first);
+      if (count > 0) consume(chunk, base, valid, first, count);
+      first += BATCH_FRAMES;
+    });
+    return grains();
+  }
+};
+
+// replace the grain field with chirplets fitted to a sound file; not real-time safe
+inline bool resynthesize(Granulator& granulator, const char* filePath) {
+  auto begin = std::chrono::steady_clock::now();
+  Analysis analysis;
+  std::vector<GrainSettings> fitted;
+  float length;
+
+  MappedBuffer mapped; // read mono float files in place, stream everything else
+  WavStream stream;
+  if (mapped.map(filePath)) {
+    fitted = analysis.run(mapped.data(), mapped.size(), mapped.sampleRate, MAX_GRAINS);
+    length = (float)mapped.size() / mapped.sampleRate;
+  } else if (stream.open(filePath)) {
+    fitted = analysis.run(stream, MAX_GRAINS);
+    length = (float)stream.frames / stream.sampleRate;
+  } else {
+    return false;
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+  for (int i = 0; i < fitted.size(); i++) {
+    granulator.settings[i] = fitted[i];
+    granulator.settings[i].id = i; // sequencers know grains by their slot in the field
+  }
+  granulator.nGrains = fitted.size();
+  printf("analyzed %s (%.1f s of audio) into %d grains in %.2f s\n", filePath, length, (int)fitted.size(), seconds);
+  return true;
+}
@@ -0,0 +1,290 @@
+/* bench.cpp written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file times the parts of ReSynth whose speed the notes quote, without opening a window or a sound card. It
+ * builds like granular-resynth.cpp and takes what to time: bench resample, bench stretch, bench operators, bench
+ * steal, or bench all (the default); bench rates checks that grains rendered below SAMPLE_RATE still sound right.
+ * Times are wall clock on whatever else the machine is doing, so run it a few times and read the best.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "buffer.h"
+#include "grains.h"
+#include "offline.h"
+
+const char* BENCH_FILE = "bench-source.wav"; // scratch, deleted when the bench is done
+const int BENCH_BLOCK = 768; // what granular-resynth.cpp asks the sound card for
+const double BENCH_SECONDS = 60; // of audio per measurement
+
+double seconds(std::chrono::steady_clock::time_point started) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
+
+// Buffer::load of ten seconds of a tone at other rates, at every quality; the resampler runs as the file streams in
+void resample() {
+  const int rates[] = {44100, 96000, 22050};
+  const char* names[] = {"draft", "good", "high", "best"};
+  for (int rate : rates) {
+    const long frames = 10L * rate;
+    std::vector<float> tone(frames);
+    for (long i = 0; i < frames; i++) tone[i] = 0.5f * sinf(2 * M_PI * 1000 * i / rate);
+    WavWriter wav;
+    if (!wav.open(BENCH_FILE, 1, rate) || !wav.write(tone.data(), frames, frames)) return;
+    wav.close();
+    for (int q = Resampler::DRAFT; q <= Resampler::BEST; q++) {
+      Buffer b;
+      const auto started = std::chrono::steady_clock::now();
+      b.load(BENCH_FILE, q);
+      const double took = seconds(started);
+      printf("resample %6d -> %d, %-5s %6.0fx real time\n", rate, SAMPLE_RATE, names[q], 10 / took);
+    }
+  }
+  remove(BENCH_FILE);
+}
+
+// the time-stretch layer over a four second tone, for BENCH_SECONDS; returns the seconds it took and
+// sets level to the rms of the bus channels summed, per stream
+double stretchRun(int streams, float stretch, float pitch, float size, double& level) {
+  static std::vector<float> source;
+  if (source.empty()) {
+    source.resize(4 * SAMPLE_RATE);
+    for (size_t i = 0; i < source.size(); i++) source[i] = sinf(2 * M_PI * 440 * i / SAMPLE_RATE);
+  }
+  Spatializer spatializer;
+  spatializer.configure(Spatializer::PAN, SpeakerLayout::stereo());
+  SpatialBus& bus = spatializer.bus;
+  TimeStretch t;
+  t.gain.set(1);
+  t.stretch.set(stretch);
+  t.pitch.set(pitch);
+  t.grainSize.set(size);
+  t.streams.set(streams);
+  const long blocks = lround(BENCH_SECONDS * SAMPLE_RATE / BENCH_BLOCK);
+  double energy = 0;
+  const auto started = std::chrono::steady_clock::now();
+  for (long b = 0; b < blocks; b++) {
+    spatializer.clear(BENCH_BLOCK);
+    t.render(source.data(), (long)source.size(), spatializer, true);
+    for (int i = 0; i < BENCH_BLOCK; i++) {
+      float x = 0;
+      for (int c = 0; c < bus.channels; c++) x += bus.channel(c)[i];
+      energy += x * x;
+    }
+  }
+  const double took = seconds(started);
+  level = sqrt(energy / (blocks * BENCH_BLOCK)) / streams;
+  return took;
+}
+
+// the time-stretch layer stretched 2x and up an octave, with every stream count, at the default grain size and
+// the slider's smallest. Then a level check at both: unstretched and unshifted, every grain reads the tone in phase
+// and the overlap-add gives it back at its own level, so a level short of the tone's 0.707 is grains that found no
+// free slot and were dropped
+void stretch() {
+  const float sizes[] = {0.08f, MIN_STRETCH_SIZE / (float)SAMPLE_RATE};
+  double level;
+  for (float size : sizes)
+    for (int n = 1; n <= MAX_STREAMS; n *= 2)
+      printf("stretch %d stream%s, %3.0f ms grains %6.0fx real time\n", n, n > 1 ? "s" : " ", size * 1000,
+             BENCH_SECONDS / stretchRun(n, 2, 12, size, level));
+  for (float size : sizes) {
+    stretchRun(1, 1, 0, size, level);
+    printf("stretch level, %3.0f ms grains %.3f\n", size * 1000, level);
+  }
+}
+
+// one voice kind rendering second-long chirps back to back, in ns per sample of grain
+template <class V> void voice(const char* name) {
+  GrainParams g;
+  g.carrier_start = 220;
+  g.carrier_end = 440;
+  g.modulator_start = 300;
+  g.modulator_end = 500;
+  g.md_start = 100;
+  g.md_end = 400;
+  g.duration = 1;
+  g.envelope = 0.5;
+  g.gain = 1;
+  static SpatialBus bus; // lanes and all, like the Spatializer's
+  bus.resize(2);
+  V v;
+  v.gains.push(0, 1.0f);
+  const int blocks = SAMPLE_RATE / BENCH_BLOCK; // whole blocks, all inside the grain
+  const int grains = (int)BENCH_SECONDS;
+  const auto started = std::chrono::steady_clock::now();
+  for (int k = 0; k < grains; k++) {
+    v.set(g, 1, HANN);
+    for (int b = 0; b < blocks; b++) {
+      bus.clear(BENCH_BLOCK);
+      v.render(bus, 0);
+    }
+  }
+  const double took = seconds(started);
+  printf("grain %-12s %5.1f ns/sample\n", name, took / ((double)grains * blocks * BENCH_BLOCK) * 1e9);
+}
+
+// the table-sine FM grain the governor falls back to, and every operator algorithm
+void operators() {
+  voice<CheapGrain>("2-op");
+  voice<OperatorGrain<Stack3>>("stack3");
+  voice<OperatorGrain<Stack4>>("stack4");
+  voice<OperatorGrain<TwoPairs>>("two pairs");
+  voice<OperatorGrain<Branch>>("branch");
+  voice<OperatorGrain<DX1>>("dx1");
+  voice<OperatorGrain<Organ>>("organ");
+}
+
+// single grains of one voice kind, each rendered through an OfflineRenderer with sub-rate grains on and off; the
+// rate the engine picks should leave them sounding the same, so the error (rms of the difference over rms of the
+// full-rate render) stays small wherever a grain went sub-rate, and is 0 wherever it didn't
+template <class V> void rates(const char* name, int algorithm) {
+  static OfflineRenderer renderer;
+  GrainEngine::Config config;
+  const long frames = SAMPLE_RATE;
+  std::vector<float> full(2 * frames), sub(2 * frames);
+  const float carriers[] = {200, 800, 1500, 5000};
+  const float depths[] = {0, 300};
+  int lowered = 0, grains = 0;
+  double worst = 0;
+  float worstCarrier = 0, worstDepth = 0;
+  for (float carrier : carriers)
+    for (float depth : depths) {
+      GrainParams g;
+      g.carrier_start = g.carrier_end = carrier;
+      g.modulator_start = g.modulator_end = 300;
+      g.modulator_depth = 0;
+      g.md_start = g.md_end = depth;
+      g.envelope = 0.5;
+      g.gain = 1;
+      g.duration = 0.5;
+      g.window = HANN;
+      g.algorithm = algorithm;
+      g.size = 0;
+      const std::vector<TimedTrigger> triggers{{0, g, 1, HANN}};
+      config.subRate = false;
+      renderer.configure(config);
+      renderer.render(triggers, frames, full.data());
+      config.subRate = true;
+      renderer.configure(config);
+      renderer.render(triggers, frames, sub.data());
+      double difference = 0, level = 0;
+      for (size_t i = 0; i < full.size(); i++) {
+        difference += (sub[i] - full[i]) * (sub[i] - full[i]);
+        level += full[i] * full[i];
+      }
+      if (level == 0) continue; // nothing to compare
+      const double error = sqrt(difference / level);
+      grains++;
+      lowered += renderer.engine.rateShift(V::top(g)) < 0;
+      if (error > worst) {
+        worst = error;
+        worstCarrier = carrier;
+        worstDepth = depth;
+      }
+    }
+  printf("rates %-12s %d of %d grains sub-rate, worst error %.2f%%", name, lowered, grains, worst * 100);
+  if (worst > 0) printf(" (carrier %.0f Hz, depth %.0f)", worstCarrier, worstDepth);
+  printf("\n");
+}
+
+// every voice kind's grains at the rates the engine picks for them
+void rates() {
+  rates<CheapGrain>("2-op", 0);
+  rates<OperatorGrain<Stack3>>("stack3", 1);
+  rates<OperatorGrain<Stack4>>("stack4", 2);
+  rates<OperatorGrain<TwoPairs>>("two pairs", 3);
+  rates<OperatorGrain<Branch>>("branch", 4);
+  rates<OperatorGrain<DX1>>("dx1", 5);
+  rates<OperatorGrain<Organ>>("organ", 6);
+}
+
+// a fixed, lopsided block of grains through the render workers, split statically and with stealing. The first
+// quarter of the queue are six-operator grains that sound through the whole block, the rest three-operator grains
+// with a sixteenth of the block left, so the static split hands the first worker most of the work. Then again with
+// a busy thread on every core, the way the live callback meets another program. Prints the mean and worst block
+// against RENDER_BUDGET, and how many blocks went past it
+void steal() {
+  const int threads = std::thread::hardware_concurrency();
+  const int frames = BENCH_BLOCK;
+  static RenderWorkers workers;
+  workers.start(threads - 1, 2);
+  if (workers.workers.empty()) {
+    printf("steal: needs at least two cores\n");
+    return;
+  }
+  const int grains = 384, heavy = grains / 4;
+  std::vector<OperatorGrain<DX1>> whole(heavy);
+  std::vector<OperatorGrain<Stack3>> ending(grains - heavy);
+  GrainParams g;
+  g.carrier_start = g.carrier_end = 440;
+  g.modulator_start = g.modulator_end = 300;
+  g.md_start = g.md_end = 300;
+  g.envelope = 0.5;
+  g.gain = 1.0f / grains;
+  for (auto& v : whole) v.gains.push(0, 1.0f);
+  for (auto& v : ending) v.gains.push(1, 1.0f);
+  static SpatialBus out;
+  static MultiRateBus rates;
+  out.resize(2);
+  rates.resize(2, true);
+  static RenderQueue queue;
+  const double budget = 1000 * RENDER_BUDGET * frames / SAMPLE_RATE;
+  const int blocks = (int)(BENCH_SECONDS * SAMPLE_RATE / frames);
+
+  std::atomic<bool> busy{false};
+  for (int load = 0; load < 2; load++) {
+    std::vector<std::thread> hogs;
+    busy = load;
+    for (int t = 0; load && t < threads; t++)
+      hogs.emplace_back([&busy] {
+        volatile double x = 1;
+        while (busy) x = x * 1.0000001;
+      });
+    for (int stealing = 0; stealing < 2; stealing++) {
+      workers.stealing = stealing;
+      RenderWorkers::Stats& stats = stealing ? workers.stealingStats : workers.staticStats;
+      stats.seconds = stats.worst = 0;
+      stats.blocks = stats.late = stats.overruns = stats.taken = 0;
+      for (int b = 0; b < blocks; b++) {
+        out.clear(frames);
+        rates.clear(frames);
+        queue.clear();
+        g.duration = 1;
+        for (auto& v : whole) {
+          v.set(g, 1, HANN);
+          queue.push(&v, 0);
+        }
+        g.duration = (float)frames / 16 / SAMPLE_RATE;
+        for (auto& v : ending) {
+          v.set(g, 1, HANN);
+          queue.push(&v, 0);
+        }
+        workers.render(queue, out, rates);
+      }
+      printf("steal %-8s %-10s %.3f ms per block, worst %.3f ms against a %.3f ms budget, %d of %d blocks past it\n",
+             stealing ? "stealing" : "static", load ? "under load" : "quiet", 1000 * stats.seconds / stats.blocks,
+             1000 * stats.worst, budget, (int)stats.overruns, (int)stats.blocks);
+    }
+    busy = false;
+    for (std::thread& h : hogs) h.join();
+  }
+  workers.stop();
+}
+
+int main(int argc, char* argv[]) {
+  const char* which = (argc > 1) ? argv[1] : "all";
+  const bool all = strcmp(which, "all") == 0;
+  bool ran = false;
+  if (all || strcmp(which, "resample") == 0) resample(), ran = true;
+  if (all || strcmp(which, "stretch") == 0) stretch(), ran = true;
+  if (all || strcmp(which, "operators") == 0) operators(), ran = true;
+  if (all || strcmp(which, "rates") == 0) rates(), ran = true;
+  if (all || strcmp(which, "steal") == 0) steal(), ran = true;
+  if (!ran) printf("usage: bench [resample | stretch | operators | rates | steal | all]\n");
+  return 0;
+}
@@ -0,0 +1,174 @@
+/* bounce.h written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file defines the Bounce: a saved session (session.h) played offline into a WAV file, as fast as the CPU
+ * allows. Each sequencer's steps are laid out on its own copy of the transport and played from its compiled pattern
+ * with the same dice the audio callback rolls, then rendered into a stem by its own OfflineRenderer through the same
+ * grain voices; the time-stretch layer renders into a stem of its own. Stems can render on their own threads, a
+ * chunk at a time; they are summed in slot order and put through the gain slider and tanh like the live output, so
+ * the mix comes out bit-identical for a given seed however many threads render it.
+ * It is not a copy of what the live app would have played: everything starts together at frame 0 and nothing is
+ * edited along the way, a frozen sequencer plays the grains its loop was rendered from (the same voices, so the
+ * same sound up to rounding), and grains triggered by hovering over the field are not part of a session.
+ */
+
+# pragma once
+
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "buffer.h"
+#include "offline.h"
+#include "sequence.h"
+#include "transport.h"
+
+const long BOUNCE_CHUNK = 1000 * OFFLINE_BLOCK; // about 10 seconds; what each stem renders between mixes
+
+struct Bounce {
+  struct Stem {
+    int slot;
+    std::vector<TimedTrigger> triggers;
+    OfflineRenderer renderer;
+    std::vector<float> chunk; // planar, channels x BOUNCE_CHUNK
+    WavWriter wav; // only opened when stems are written
+  };
+
+  // the time-stretch layer: the live one's sliders on its own engine and speakers, rendered a block at a time like
+  // Granulator::render does under the grains
+  struct StretchLayer {
+    TimeStretch stretcher;
+    Spatializer spatializer;
+    al::AudioIOData io;
+    bool spatialize = false;
+    const float* data = nullptr;
+    long frames = 0;
+    std::vector<float> chunk; // planar, channels x BOUNCE_CHUNK
+    WavWriter wav; // only opened when stems are written
+
+    void configure(Granulator& live) {
+      stretcher.gain.set(live.stretcher.gain.get());
+      stretcher.stretch.set(live.stretcher.stretch.get());
+      stretcher.pitch.set(live.stretcher.pitch.get());
+      stretcher.grainSize.set(live.stretcher.grainSize.get());
+      stretcher.streams.set(live.stretcher.streams.get());
+      spatializer.configure(live.engine.spatializer.mode, live.engine.spatializer.layout);
+      spatialize = live.spatialize;
+      data = live.engine.sampleData;
+      frames = live.engine.sampleFrames;
+      io.framesPerBuffer(OFFLINE_BLOCK);
+      io.channels(spatializer.outputs, true);
+      chunk.resize((size_t)spatializer.outputs * BOUNCE_CHUNK);
+    }
+
+    // the next n frames into chunk; like OfflineRenderer::render, every call but the last has to be whole blocks
+    void render(long n) {
+      for (long b = 0; b < n; b += OFFLINE_BLOCK) {
+        const int m = (int)std::min((long)OFFLINE_BLOCK, n - b);
+        io.zeroOut();
+        spatializer.clear(OFFLINE_BLOCK);
+        stretcher.render(data, frames, spatializer, spatialize);
+        spatializer.decode(io);
+        for (int c = 0; c < spatializer.outputs; c++) std::copy(io.outBuffer(c), io.outBuffer(c) + m, chunk.data() + c * n + b);
+      }
+    }
+  };
+
+  // every grain a sequencer starts in its first frames, where and how the audio callback would start it
+  static std::vector<TimedTrigger> schedule(Sequencer& s, float tempo, const GrainScale& global, long frames) {
+    Transport transport;
+    transport.tempo.set(tempo);
+    std::vector<Sequencer*> one{&s};
+    s.update();
+    std::vector<TimedTrigger> triggers;
+    for (long b = 0; b < frames; b += OFFLINE_BLOCK) {
+      transport.schedule(one, OFFLINE_BLOCK);
+      const long long now = transport.now - OFFLINE_BLOCK;
+      s.scale = s.scaling(global);
+      s.pattern.pickUp();
+      s.pattern.collect(); // what the graphics thread does live, or a table pickUp retires would never be deleted
+      auto fire = [&](const PatternEvent& e, int offset) {
+        triggers.push_back({(long)(now + offset), e.settings, e.gain >= 0 ? e.gain : s.gain, e.window >= 0 ? e.window : s.window});
+        s.scale.apply(triggers.back().settings);
+      };
+      s.pattern.flush(now, OFFLINE_BLOCK, fire);
+      for (int e = 0; e < transport.count && s.pattern.steps() > 0; e++) {
+        s.pattern.tick(now + transport.events[e].offset, s.clock.interval, now, OFFLINE_BLOCK, fire);
+        s.pattern.advance();
+      }
+    }
+    std::stable_sort(triggers.begin(), triggers.end(), [](const TimedTrigger& a, const TimedTrigger& b) { return a.time < b.time; });
+    return triggers;
+  }
+
+  // render seconds of the session into fileName, plus a stem per sequencer (fileName with -<its number> before the .wav)
+  // and one for the stretch layer (-stretch) when stems is set; threads 1 renders everything on the calling thread
+  static bool render(Granulator& live, std::vector<std::unique_ptr<Sequencer>>& sequencers, Transport& transport,
+                     double seconds, const std::string& fileName, bool stems, int threads, uint32_t seed) {
+    const auto started = std::chrono::steady_clock::now();
+    const long frames = lround(seconds * SAMPLE_RATE);
+    std::vector<std::unique_ptr<Stem>> parts;
+    for (auto& s : sequencers) {
+      if (!s) continue;
+      s->reseed(seed);
+      parts.push_back(std::make_unique<Stem>());
+      Stem& stem = *parts.back();
+      stem.slot = s->id;
+      stem.triggers = schedule(*s, transport.tempo, live.scaling(), frames);
+      stem.renderer.configure(live.config());
+      stem.chunk.resize((size_t)stem.renderer.channels * BOUNCE_CHUNK);
+    }
+    const int channels = live.engine.spatializer.outputs;
+    std::unique_ptr<StretchLayer> layer; // only when it would be heard
+    if (live.stretcher.gain > 0 && live.engine.sampleData != nullptr && live.engine.sampleFrames > 0) {
+      layer = std::make_unique<StretchLayer>();
+      layer->configure(live);
+    }
+
+    WavWriter mix;
+    if (!mix.open(fileName.c_str(), channels)) return false;
+    if (stems) {
+      const std::string base = (fileName.size() > 4 && fileName.substr(fileName.size() - 4) == ".wav") ? fileName.substr(0, fileName.size() - 4) : fileName;
+      for (auto& stem : parts)
+        if (!stem->wav.open((base + "-" + std::to_string(stem->slot + 1) + ".wav").c_str(), channels)) return false;
+      if (layer && !layer->wav.open((base + "-stretch.wav").c_str(), channels)) return false;
+    }
+
+    threads = std::max(1, std::min(threads, (int)parts.size()));
+    std::vector<float> out((size_t)channels * BOUNCE_CHUNK);
+    const float gain = live.gain;
+    for (long b = 0; b < frames; b += BOUNCE_CHUNK) {
+      const long n = std::min(BOUNCE_CHUNK, frames - b);
+      auto work = [&](int first) { // every threads-th stem from first
+        for (int k = first; k < (int)parts.size(); k += threads) parts[k]->renderer.render(parts[k]->triggers, n, parts[k]->chunk.data());
+      };
+      std::vector<std::thread> helpers;
+      for (int t = 1; t < threads; t++) helpers.emplace_back(work, t);
+      work(0);
+      if (layer) layer->render(n); // on this thread, alongside the helpers
+      for (std::thread& h : helpers) h.join();
+
+      std::fill(out.begin(), out.end(), 0.0f);
+      for (auto& stem : parts) { // in slot order, whichever thread rendered it
+        for (int c = 0; c < channels; c++)
+          for (long t = 0; t < n; t++) out[c * n + t] += stem->chunk[c * n + t];
+        if (stems) stem->wav.write(stem->chunk.data(), n, n);
+      }
+      if (layer) { // under the grains, last
+        for (int c = 0; c < channels; c++)
+          for (long t = 0; t < n; t++) out[c * n + t] += layer->chunk[c * n + t];
+        if (stems) layer->wav.write(layer->chunk.data(), n, n);
+      }
+      for (float& x : out) x = tanh(x * gain); // like the live output
+      if (!mix.write(out.data(), n, n)) {
+        printf("failed writing %s\n", fileName.c_str());
+        return false;
+      }
+    }
+
+    const double took = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    printf("rendered %.1f s of %d sequencers%s into %s in %.1f s (%.0fx real time)\n", seconds, (int)parts.size(), layer ? " and the stretch layer" : "", fileName.c_str(), took, seconds / took);
+    return true;
+  }
+};
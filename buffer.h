@@ -6,11 +6,137 @@
 
 # pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <string>
 #include <vector>
 #include "grains.h"
+#include "interpolate.h"
+#include "resample.h"
+#include "simd.h"
 #include "dr_wav.h" // copied from MAT240B-2021 repo
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// reads a WAV file a block at a time with drwav_read_pcm_frames_f32, downmixed to mono or split into channels,
+// so long files never sit in memory whole
+struct WavStream {
+  drwav wav;
+  bool opened = false;
+  unsigned int channels = 0;
+  unsigned int sampleRate = SAMPLE_RATE;
+  drwav_uint64 frames = 0; // total frames in the file
+  std::vector<float> interleaved;
+
+  ~WavStream() { close(); }
+
+  bool open(const char* filePath) {
+    close();
+    if (!drwav_init_file(&wav, filePath, NULL)) {
+      printf("failed to load %s\n", filePath);
+      return false;
+    }
+    channels = wav.channels;
+    sampleRate = wav.sampleRate;
+    frames = wav.totalPCMFrameCount;
+    if (channels < 1) {
+      printf("can't handle %d channels\n", channels);
+      drwav_uninit(&wav);
+      return false;
+    }
+    opened = true;
+    return true;
+  }
+
+  void close() {
+    if (opened) drwav_uninit(&wav);
+    opened = false;
+  }
+
+  // read up to n mono frames into out; returns how many were read, 0 at the end of the file
+  long read(float* out, long n) {
+    if (!opened) return 0;
+    if (channels == 1) return drwav_read_pcm_frames_f32(&wav, n, out);
+    interleaved.resize(n * channels);
+    long got = drwav_read_pcm_frames_f32(&wav, n, interleaved.data());
+    simd::downmix(interleaved.data(), channels, got, out);
+    return got;
+  }
+
+  // read up to n frames, one array per channel
+  long read(float* const* out, long n) {
+    if (!opened) return 0;
+    if (channels == 1) return drwav_read_pcm_frames_f32(&wav, n, out[0]);
+    interleaved.resize(n * channels);
+    long got = drwav_read_pcm_frames_f32(&wav, n, interleaved.data());
+    simd::deinterleave(interleaved.data(), channels, got, out);
+    return got;
+  }
+
+  // feed f(chunk, base, valid) fixed-size chunks that overlap by size - hop frames. chunk[0] is frame base of the file
+  // (negative for the leadIn zeros in front of the first chunk), and frames past valid are zero. Memory stays at one chunk.
+  template <class F> void chunks(long size, long hop, long leadIn, F f) {
+    std::vector<float> chunk(size, 0.0f);
+    long base = -leadIn;
+    long valid = leadIn + read(chunk.data() + leadIn, size - leadIn);
+    while (true) {
+      f(chunk.data(), base, valid);
+      if (valid < size) return; // that was the end of the file
+      std::copy(chunk.begin() + hop, chunk.end(), chunk.begin());
+      std::fill(chunk.end() - hop, chunk.end(), 0.0f);
+      valid = size - hop + read(chunk.data() + size - hop, hop);
+      base += hop;
+    }
+  }
+};
+
+// writes a WAV file a block at a time, 32-bit float like Buffer::save, from planar channels; for renders too
+// long to hold in memory
+struct WavWriter {
+  drwav wav;
+  bool opened = false;
+  int channels = 0;
+  std::vector<float> interleaved;
+
+  ~WavWriter() { close(); }
+
+  bool open(const char* fileName, int outputs, int sampleRate = SAMPLE_RATE) {
+    close();
+    drwav_data_format format;
+    format.container = drwav_container_riff;
+    format.format = DR_WAVE_FORMAT_IEEE_FLOAT;
+    format.channels = outputs;
+    format.sampleRate = sampleRate;
+    format.bitsPerSample = 32;
+    if (!drwav_init_file_write(&wav, fileName, &format, nullptr)) {
+      printf("failed to open %s for writing\n", fileName);
+      return false;
+    }
+    channels = outputs;
+    opened = true;
+    return true;
+  }
+
+  // frames of every channel, channel c starting at planar + c * stride
+  bool write(const float* planar, long frames, long stride) {
+    interleaved.resize((size_t)frames * channels);
+    for (int c = 0; c < channels; c++)
+      for (long t = 0; t < frames; t++) interleaved[t * channels + c] = planar[c * stride + t];
+    return drwav_write_pcm_frames(&wav, frames, interleaved.data()) == (drwav_uint64)frames;
+  }
+
+  void close() {
+    if (opened) drwav_uninit(&wav);
+    opened = false;
+  }
+};
+
 //copied and pasted from synths.h
 struct Buffer : std::vector<float> {
   int sampleRate{SAMPLE_RATE};
@@ -39,33 +165,28 @@ struct Buffer : std::vector<float> {
     drwav_uninit(&wav);
   }
 
-  bool load(const std::string& fileName) { return load(fileName.c_str()); }
-  bool load(const char* filePath) {
-    unsigned int channels;
-    unsigned int sampleRate;
-    drwav_uint64 totalPCMFrameCount;
-    float* pSampleData = drwav_open_file_and_read_pcm_frames_f32(
-        filePath, &channels, &sampleRate, &totalPCMFrameCount, NULL);
-    if (pSampleData == NULL) {
-      printf("failed to load %s\n", filePath);
-      return false;
-    }
+  bool load(const std::string& fileName, int quality = Resampler::HIGH) { return load(fileName.c_str(), quality); }
+  bool load(const char* filePath, int quality = Resampler::HIGH) { // decoded straight into the vector, a block at a time
+    WavStream stream;
+    if (!stream.open(filePath)) return false;
+    sampleRate = SAMPLE_RATE;
 
-    //
-    if (channels == 1)
-      for (int i = 0; i < totalPCMFrameCount; i++) {
-        push_back(pSampleData[i]);
-      }
-    else if (channels == 2) {
-      for (int i = 0; i < totalPCMFrameCount; i++) {
-        push_back((pSampleData[2 * i] + pSampleData[2 * i + 1]) / 2);
-      }
-    } else {
-      printf("can't handle %d channels\n", channels);
-      return false;
+    Resampler resampler;
+    resampler.setup(stream.sampleRate, SAMPLE_RATE, quality);
+    if (resampler.active()) { // converted to SAMPLE_RATE as it streams in
+      reserve(size() + resampler.length(stream.frames)); // the one allocation
+      std::vector<float> block(16384);
+      long n;
+      while ((n = stream.read(block.data(), block.size())) > 0) resampler.push(block.data(), n, *this);
+      resampler.flush(*this);
+      return true;
     }
 
-    drwav_free(pSampleData, NULL);
+    const long start = size();
+    resize(start + stream.frames); // the one allocation
+    long got = 0, n;
+    while ((n = stream.read(data() + start + got, std::min(16384L, (long)stream.frames - got))) > 0) got += n;
+    resize(start + got);
     return true;
   }
 
@@ -94,6 +215,11 @@ struct Buffer : std::vector<float> {
   float operator[](const float index) const { return get(index); }
   float phasor(float index) const { return get(size() * index); }
 
+  // count samples from index start, stepping by increment, into out; returns where the next block starts
+  double read(double start, double increment, int count, float* out, Interpolation interpolation = Interpolation::LINEAR) const {
+    return interpolate::read(data(), size(), start, increment, count, out, interpolation);
+  }
+
   void add(float index, const float value) {
     index = al::wrap(index, (float)size());
     assert(index >= 0.0f);
@@ -105,4 +231,155 @@ struct Buffer : std::vector<float> {
     std::vector<float>::operator[](i) += value * (1 - t);
     std::vector<float>::operator[](j) += value * t;
   }
-};
\ No newline at end of file
+};
+
+// every channel of a file kept separate, e.g. the four components of a B-format recording
+struct PlanarBuffer : std::vector<Buffer> {
+  int sampleRate{SAMPLE_RATE};
+
+  bool load(const std::string& fileName, int quality = Resampler::HIGH) { return load(fileName.c_str(), quality); }
+  bool load(const char* filePath, int quality = Resampler::HIGH) {
+    WavStream stream;
+    if (!stream.open(filePath)) return false;
+    sampleRate = SAMPLE_RATE;
+
+    std::vector<Resampler> resamplers(stream.channels);
+    for (Resampler& r : resamplers) r.setup(stream.sampleRate, SAMPLE_RATE, quality);
+    const bool resampling = resamplers[0].active();
+
+    clear();
+    resize(stream.channels);
+    for (Buffer& b : *this) {
+      b.sampleRate = sampleRate;
+      if (resampling) b.reserve(resamplers[0].length(stream.frames)); // one allocation per channel
+      else b.assign(stream.frames, 0.0f);
+    }
+
+    std::vector<float*> out(stream.channels);
+    if (resampling) {
+      std::vector<float> block(stream.channels * 4096L);
+      for (unsigned c = 0; c < stream.channels; c++) out[c] = block.data() + c * 4096L;
+      long n;
+      while ((n = stream.read(out.data(), 4096)) > 0)
+        for (unsigned c = 0; c < stream.channels; c++) resamplers[c].push(out[c], n, (*this)[c]);
+      for (unsigned c = 0; c < stream.channels; c++) resamplers[c].flush((*this)[c]);
+      return true;
+    }
+
+    long got = 0, n;
+    do {
+      for (unsigned c = 0; c < stream.channels; c++) out[c] = (*this)[c].data() + got;
+      n = stream.read(out.data(), std::min(16384L, (long)stream.frames - got));
+      got += n;
+    } while (n > 0);
+    for (Buffer& b : *this) b.resize(got);
+    return true;
+  }
+};
+
+// a read-only source that memory-maps mono 32-bit float WAVs and reads their samples in place, so loading is
+// near-instant, nothing is copied, and every process (and grain) reading the file shares the page cache.
+// Any other format, or a file at a rate other than SAMPLE_RATE, falls back to decoding (and resampling) into a Buffer.
+struct MappedBuffer {
+  const float* samples = nullptr;
+  long frames = 0;
+  int sampleRate = SAMPLE_RATE;
+
+  void* mapping = nullptr;
+  size_t mappingSize = 0;
+  Buffer decoded; // only used when the file can't be mapped
+
+  MappedBuffer() {}
+  MappedBuffer(const MappedBuffer&) = delete;
+  MappedBuffer& operator=(const MappedBuffer&) = delete;
+  ~MappedBuffer() { unmap(); }
+
+  const float* data() const { return samples; }
+  long size() const { return frames; }
+  bool mapped() const { return mapping != nullptr; }
+
+  double read(double start, double increment, int count, float* out, Interpolation interpolation = Interpolation::LINEAR) const {
+    return interpolate::read(samples, frames, start, increment, count, out, interpolation);
+  }
+
+  bool load(const std::string& fileName) { return load(fileName.c_str()); }
+  bool load(const char* filePath) {
+    unmap();
+    decoded.clear();
+    if (map(filePath)) {
+      if (sampleRate == SAMPLE_RATE) return true;
+      unmap();
+    }
+    if (!decoded.load(filePath)) return false;
+    samples = decoded.data();
+    frames = decoded.size();
+    sampleRate = decoded.sampleRate;
+    return true;
+  }
+
+  // map the file if its data chunk is mono IEEE float, 32 bits, and 4-byte aligned; whatever was mapped before is let go
+  bool map(const char* filePath) {
+    unmap();
+#if defined(_WIN32)
+    return false;
+#else
+    int fd = open(filePath, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < 12) {
+      close(fd);
+      return false;
+    }
+    void* m = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if (m == MAP_FAILED) return false;
+
+    const uint8_t* bytes = (const uint8_t*)m;
+    const size_t length = info.st_size;
+    auto u16 = [&](size_t at) { return (uint32_t)bytes[at] | (uint32_t)bytes[at + 1] << 8; };
+    auto u32 = [&](size_t at) { return u16(at) | u16(at + 2) << 16; };
+
+    bool isFloat = false;
+    unsigned channels = 0, rate = 0, bits = 0;
+    size_t dataAt = 0, dataSize = 0;
+    if (memcmp(bytes, "RIFF", 4) == 0 && memcmp(bytes + 8, "WAVE", 4) == 0) {
+      for (size_t at = 12; at + 8 <= length;) {
+        const uint32_t size = u32(at + 4);
+        if (memcmp(bytes + at, "fmt ", 4) == 0 && size >= 16 && at + 8 + size <= length) {
+          unsigned format = u16(at + 8);
+          channels = u16(at + 10);
+          rate = u32(at + 12);
+          bits = u16(at + 22);
+          if (format == 0xFFFE && size >= 26) format = u16(at + 32); // WAVE_FORMAT_EXTENSIBLE: first bytes of the subformat
+          isFloat = (format == DR_WAVE_FORMAT_IEEE_FLOAT);
+        } else if (memcmp(bytes + at, "data", 4) == 0) {
+          dataAt = at + 8;
+          dataSize = std::min((size_t)size, length - dataAt);
+          break;
+        }
+        at += 8 + size + (size & 1); // chunks are padded to even sizes
+      }
+    }
+
+    if (!isFloat || channels != 1 || bits != 32 || dataAt == 0 || dataAt % 4 != 0) {
+      munmap(m, length);
+      return false;
+    }
+    mapping = m;
+    mappingSize = length;
+    samples = (const float*)(bytes + dataAt);
+    frames = dataSize / 4;
+    sampleRate = rate;
+    return true;
+#endif
+  }
+
+  void unmap() {
+#if !defined(_WIN32)
+    if (mapping != nullptr) munmap(mapping, mappingSize);
+#endif
+    mapping = nullptr;
+    samples = nullptr;
+    frames = 0;
+  }
+};
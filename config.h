@@ -0,0 +1,17 @@
+/* config.h written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file holds the constants shared by grains.h, sequence.h, buffer.h and the spatializer
+ */
+
+# pragma once
+
+// CONSTANTS
+
+const int SAMPLE_RATE = 48000; 
+const int BLOCK_SIZE = 2048; // largest audio block we ever render
+const int OUTPUT_CHANNELS = 2; // default, override on the command line for larger speaker arrays
+const int MAX_OUTPUT_CHANNELS = 32;
+
+const int MAX_GRAINS = 1000;
+const int MAX_DURATION = 1.0;
+const double MAX_FREQUENCY = 127;
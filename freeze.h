@@ -0,0 +1,180 @@
+/* freeze.h written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file defines loop freezing: a sequencer whose pattern, rate, gain, window and scaling haven't changed replays exactly
+ * the same grains every cycle, so one cycle (plus the tails of its last grains) is rendered offline in the
+ * background and the audio thread mixes copies of it instead of triggering grains. Any edit makes the loop stale;
+ * the sequencer goes straight back to live grains and a new cycle is rendered once the edits settle. Loops are
+ * rendered from the same compiled table the audio thread plays, so ratchets, nudges and locks come out the same;
+ * a pattern with a step that might not play stays live.
+ */
+
+# pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "offline.h"
+#include "sequence.h"
+
+const float MAX_LOOP_SECONDS = 30; // longer cycles stay live; a frozen loop keeps every speaker channel in memory
+const int MAX_LOOP_PLAYS = 64; // cycles sounding at once: one a step long at the fastest rate, plus a second of tails
+const int LOOP_FADE = 480; // samples a stale loop fades out over
+const int SETTLE_FRAMES = 30; // graphics frames a sequencer has to stay unchanged before it is rendered
+
+// what a frozen loop was rendered from; when a sequencer's key stops matching, the loop is stale
+struct LoopKey {
+  long edits = -1; // of the pattern's table
+  double interval = 0; // samples per step, from the rate and the tempo
+  float gain = 0;
+  int window = -1;
+  GrainScale scale; // the sequencer's transpose and time scale with the global ones
+
+  bool operator==(const LoopKey& k) const { return edits == k.edits && interval == k.interval && gain == k.gain && window == k.window && scale == k.scale; }
+  bool operator!=(const LoopKey& k) const { return !(*this == k); }
+  static LoopKey of(const PatternTable* table, Sequencer& s, Transport& t, const GrainScale& scale) {
+    return {table ? table->edits : -1, t.interval(s.rate), s.gain, s.window, scale};
+  }
+};
+
+struct FrozenLoop {
+  LoopKey key;
+  int channels = 0;
+  long length = 0; // one cycle, plus the tails of the grains near its end
+  std::vector<float> samples; // planar, channels x length
+};
+
+struct LoopFreezer {
+  std::atomic<FrozenLoop*> incoming{nullptr}; // rendered, not yet picked up by the audio thread
+  std::atomic<FrozenLoop*> retired{nullptr}; // done with on the audio thread, deleted on the graphics thread
+  std::atomic<bool> rendering{false};
+  std::thread thread;
+  std::unique_ptr<OfflineRenderer> renderer; // render thread only; built for the first loop, reused after that
+  LoopKey requested, seen; // graphics thread: what was last sent to render, and what the sequencer was last frame
+  int settled = 0;
+
+  FrozenLoop* loop = nullptr; // audio thread: what new cycles start from
+  FrozenLoop* previous = nullptr; // audio thread: replaced, but cycles of it may still be sounding
+  LoopKey current; // audio thread: the sequencer as of the last check
+  bool frozen = false; // audio thread: whether its ticks come from the loop
+  struct Play {
+    FrozenLoop* loop;
+    long position; // negative until it starts
+    float fade; // 1 until the loop goes stale
+  };
+  Play plays[MAX_LOOP_PLAYS];
+  int playing = 0;
+
+  ~LoopFreezer() {
+    if (thread.joinable()) thread.join();
+    delete loop;
+    delete previous;
+    delete incoming.load();
+    delete retired.load();
+  }
+
+  // graphics thread, every frame, after the sequencer's update: delete what the audio thread let go of, and render
+  // the sequencer's cycle once it has settled on something that isn't frozen yet
+  void update(Sequencer& s, Transport& transport, Granulator& live) {
+    delete retired.exchange(nullptr);
+    if (!rendering && thread.joinable()) thread.join();
+
+    const PatternTable* table = s.pattern.compiled;
+    const LoopKey key = LoopKey::of(table, s, transport, s.scaling(live.scaling()));
+    if (key != seen) { // still being edited
+      seen = key;
+      settled = 0;
+      return;
+    }
+    if (!s.freeze || rendering || key == requested || ++settled < SETTLE_FRAMES) return;
+    if (key.interval <= 0 || table == nullptr || table->random) return; // stopped, or different every cycle
+    const double period = key.interval;
+    const int steps = table->steps();
+    if (steps == 0 || steps * period > MAX_LOOP_SECONDS * SAMPLE_RATE) return;
+    std::vector<TimedTrigger> triggers;
+    for (int k = 0; k < steps; k++)
+      for (int i = table->first[k]; i < table->first[k + 1]; i++) {
+        const PatternEvent& e = table->events[i];
+        triggers.push_back({lround((k + e.at) * period), e.settings, e.gain >= 0 ? e.gain : key.gain, e.window >= 0 ? e.window : key.window});
+        key.scale.apply(triggers.back().settings); // rendered transposed and stretched, as the live grains would be
+      }
+    std::stable_sort(triggers.begin(), triggers.end(), [](const TimedTrigger& a, const TimedTrigger& b) { return a.time < b.time; });
+
+    requested = key;
+    rendering = true;
+    // a step's events can land up to two steps after it; room for the converters' delay too
+    const long length = lround((steps + 1) * period + MAX_DURATION * key.scale.time * SAMPLE_RATE) + BLOCK_SIZE;
+    thread = std::thread([this, config = live.config(), triggers, key, length] {
+      if (!renderer) renderer = std::make_unique<OfflineRenderer>();
+      renderer->configure(config);
+      FrozenLoop* f = new FrozenLoop;
+      f->key = key;
+      f->channels = renderer->channels;
+      f->length = length;
+      f->samples.assign((size_t)f->channels * length, 0.0f);
+      renderer->render(triggers, length, f->samples.data());
+      delete incoming.exchange(f); // one the audio thread never picked up is stale by now
+      rendering = false;
+    });
+  }
+
+  // audio thread, with the sequencer's mutex held: pick up a new loop once the one it replaces has stopped sounding,
+  // and whether the sequencer's ticks should come from the loop instead of live grains. A sequencer only switches
+  // to its loop at the top of a cycle, and back to live grains the moment the loop goes stale
+  bool check(Sequencer& s, Transport& transport) {
+    if (previous != nullptr && retired.load() == nullptr) {
+      bool sounding = false;
+      for (int p = 0; p < playing; p++) sounding |= (plays[p].loop == previous);
+      if (!sounding) {
+        retired = previous;
+        previous = nullptr;
+      }
+    }
+    if (previous == nullptr) {
+      FrozenLoop* f = incoming.exchange(nullptr);
+      if (f != nullptr) {
+        previous = loop;
+        loop = f;
+      }
+    }
+    current = LoopKey::of(s.pattern.table, s, transport, s.scale);
+    if (!s.freeze || loop == nullptr || loop->key != current) frozen = false;
+    else if (s.pattern.atTop()) frozen = true; // the next step starts a cycle
+    return frozen;
+  }
+
+  // audio thread: the step at the top of the cycle starts another copy of the loop, offset frames into the block
+  void start(int offset) {
+    if (playing < MAX_LOOP_PLAYS) plays[playing++] = {loop, -offset, 1.0f};
+  }
+
+  // audio thread: add every sounding copy into io; copies of a stale loop fade out, since they hold steps the
+  // sequencer now plays live
+  void mix(al::AudioIOData& io) {
+    const int frames = io.framesPerBuffer();
+    for (int p = 0; p < playing;) {
+      Play& play = plays[p];
+      const FrozenLoop& f = *play.loop;
+      const bool stale = play.fade < 1 || !frozen || f.key != current; // once stale, always
+      const int skip = (int)std::clamp(-play.position, 0L, (long)frames); // frames before a new copy starts
+      const long from = std::max(0L, play.position);
+      const int n = (int)std::min((long)(frames - skip), f.length - from);
+      const int channels = std::min(f.channels, (int)io.channelsOut());
+      for (int c = 0; c < channels; c++) {
+        const float* in = &f.samples[c * f.length + from];
+        float* out = io.outBuffer(c) + skip;
+        if (!stale) {
+          simd::add(out, in, n);
+        } else {
+          float g = play.fade;
+          for (int t = 0; t < n && g > 0; t++, g -= 1.0f / LOOP_FADE) out[t] += g * in[t];
+        }
+      }
+      play.position += frames;
+      if (stale) play.fade -= (float)n / LOOP_FADE;
+      if (play.position >= f.length || play.fade <= 0) plays[p] = plays[--playing];
+      else p++;
+    }
+  }
+};
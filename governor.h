@@ -0,0 +1,102 @@
+/* governor.h written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file defines the QualityGovernor used by granular-resynth.cpp to trade quality for time when the audio
+ * callback gets close to its deadline, instead of dropping out. It measures every callback and steps through
+ * tiers, each one keeping the ones before it:
+ *   1. cap polyphony (new grains are refused above the cap)
+ *   2. steal the quietest grains down to the cap
+ *   3. trigger grains with cheap table oscillators
+ *   4. ignore hover triggers
+ * and steps back up once the callback has had headroom for a while. Tier changes are logged from the graphics thread.
+ */
+
+# pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include "config.h"
+#include "render.h"
+
+struct QualityGovernor {
+  enum Tier { FULL, CAPPED, STEALING, CHEAP_OSCILLATORS, NO_HOVER };
+
+  std::atomic<int> tier{FULL};
+  std::atomic<int> cap{MAX_GRAINS}; // polyphony cap from CAPPED on
+  std::atomic<int> voices{0}; // voices rendered in the last block
+
+  double load = 0; // fraction of the block's duration the callback took, smoothed
+  int cooldown = 0; // blocks to wait before stepping down again, so the last step can take effect
+  int calm = 0; // consecutive blocks with headroom
+  std::chrono::steady_clock::time_point started;
+
+  // a small single-producer ring the audio thread logs tier changes into
+  struct Change { int from, to; float load; int voices; };
+  static const int LOG_SIZE = 16;
+  Change changes[LOG_SIZE];
+  std::atomic<int> written{0};
+  int read = 0;
+
+  static const char* name(int t) {
+    const char* names[] = {"full quality", "polyphony cap", "steal quietest grains", "cheap oscillators", "no hover triggers"};
+    return names[t];
+  }
+
+  void begin() { started = std::chrono::steady_clock::now(); } // audio thread, top of the callback
+
+  void end(int frames) { // audio thread, bottom of the callback
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    double instant = seconds * SAMPLE_RATE / frames;
+    load = (instant > load) ? instant : load + 0.05 * (instant - load); // rise at once, fall slowly
+
+    if (cooldown > 0) cooldown--;
+    if (load > 0.8 && cooldown == 0 && tier < NO_HOVER) {
+      if (tier == FULL) cap = std::max(16, voices.load() * 3 / 4);
+      else cap = std::max(16, cap.load() * 3 / 4); // tighten the cap on the way down too
+      step(tier + 1);
+      cooldown = 8;
+      calm = 0;
+    } else if (load < 0.45) {
+      if (++calm > SAMPLE_RATE / frames && tier > FULL) { // about a second of headroom
+        step(tier - 1);
+        calm = 0;
+      }
+    } else {
+      calm = 0;
+    }
+  }
+
+  void step(int to) {
+    int w = written.load(std::memory_order_relaxed);
+    changes[w % LOG_SIZE] = {tier.load(), to, (float)load, voices.load()};
+    written.store(w + 1, std::memory_order_release);
+    tier = to;
+  }
+
+  bool allowTrigger(bool hover) const {
+    if (hover && tier >= NO_HOVER) return false;
+    return tier < CAPPED || voices < cap;
+  }
+  bool cheapOscillators() const { return tier >= CHEAP_OSCILLATORS; }
+
+  // audio thread: free the quietest queued voices so no more than cap of them render
+  void enforce(RenderQueue& queue) {
+    voices = queue.count;
+    if (tier < STEALING || queue.count <= cap) return;
+    const int keep = cap;
+    std::nth_element(queue.jobs, queue.jobs + keep, queue.jobs + queue.count,
+                     [](const RenderJob& a, const RenderJob& b) { return a.voice->level() > b.voice->level(); });
+    for (int j = keep; j < queue.count; j++) queue.jobs[j].voice->free();
+    queue.count = keep;
+  }
+
+  void printChanges() { // graphics thread
+    int w = written.load(std::memory_order_acquire);
+    if (w - read > LOG_SIZE) read = w - LOG_SIZE;
+    for (; read < w; read++) {
+      const Change& c = changes[read % LOG_SIZE];
+      printf("governor: %s -> %s (load %.2f, %d voices)\n", name(c.from), name(c.to), c.load, c.voices);
+    }
+  }
+};
@@ -6,6 +6,9 @@
 
 # pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -13,16 +16,15 @@
 #include "al/math/al_Random.hpp"  // rnd::uniform()
 #include "Gamma/Oscillator.h"
 #include "al/math/al_Functions.hpp"  // al::clip
-
-// CONSTANTS
-
-const int SAMPLE_RATE = 48000; 
-const int BLOCK_SIZE = 2048; 
-const int OUTPUT_CHANNELS = 2;
-
-const int MAX_GRAINS = 1000;
-const int MAX_DURATION = 1.0;
-const double MAX_FREQUENCY = 127;
+#include "config.h"
+#include "governor.h"
+#include "interpolate.h"
+#include "operators.h"
+#include "policies.h"
+#include "render.h"
+#include "spatial.h"
+#include "stretch.h"
+#include "window.h"
 
 // SOME METHODS
 
@@ -33,66 +35,9 @@ inline float map(float value, float low, float high, float Low, float High) { //
 
 // SOME STRUCTS
 
-// Line struct taken and adapted from Karl Yerkes' synths.h sample code
-struct Line {
-  float value = 0, target = 0, seconds = 1 / SAMPLE_RATE, increment = 0;
-
-  void set() {
-    if (seconds <= 0) seconds = 1 / SAMPLE_RATE;
-    // slope per sample
-    increment = (target - value) / (seconds * SAMPLE_RATE);
-  }
-  void set(float v, float t, float s) {
-    value = v;
-    target = t;
-    seconds = s;
-    set();
-  }
-  void set(float t, float s) {
-    target = t;
-    seconds = s;
-    set();
-  }
-  void set(float t) {
-    target = t;
-    set();
-  }
-
-  bool done() { return value == target; }
-
-  float operator()() {
-    if (value != target) {
-      value += increment;
-      if ((increment < 0) ? (value < target) : (value > target)) value = target;
-    }
-    return value;
-  }
-};
-
-struct ExpSeg {
-  Line line;
-  void set(double v, double t, double s) { line.set(log2(v), log2(t), s); }
-  void set(double t, double s) { line.set(log2(t), s); }
-  void set(double t) { line.set(log2(t)); }
-  float operator()() { return pow(2.0f, line()); }
-};
-
-struct AttackDecay {
-  Line attack, decay;
-
-  void set(float riseTime, float fallTime, float peakValue) {
-    attack.set(0, peakValue, riseTime);
-    decay.set(peakValue, 0, fallTime);
-  }
-
-  float operator()() {
-    if (!attack.done()) return attack();
-    return decay();
-  }
-};
-
 // These structs created by Stejara, drawing from examples
-struct GrainSettings {
+// what a grain sounds like and where it sits, without its mesh, so sequencer steps and event tables copy it cheaply
+struct GrainParams {
   float carrier_start;
   float carrier_end;
   float modulator_start;
@@ -103,10 +48,50 @@ struct GrainSettings {
   float envelope; 
   float gain;
   float duration;
+  float onset = 0; // seconds into the source file, for grains fitted by the analysis and sample grains
+
+  enum Type { FM, SAMPLE };
+  int type = FM; // which voice plays it
+  float rate = 1; // playback rate of a sample grain
+  int window = TRIANGLE; // envelope shape, see window.h
+  enum Glide { EXP_GLIDE, LINEAR_GLIDE };
+  int glide = EXP_GLIDE; // how FM grains move between their start and end frequencies
+  int algorithm = 0; // 0 for the two-operator chirplet, otherwise one of the multi-operator algorithms in operators.h
 
   al::Vec3f position;
-  al::Mesh mesh;
   float size;
+  int id = -1; // its slot in the field, which is how sequencers tell grains apart
+
+  // every frequency times ratio; the deviation goes with them so FM grains keep their timbre
+  void transpose(float ratio) {
+    carrier_start *= ratio;
+    carrier_end *= ratio;
+    modulator_start *= ratio;
+    modulator_end *= ratio;
+    md_start *= ratio;
+    md_end *= ratio;
+    rate *= ratio;
+  }
+};
+
+// transposition and time scaling, applied to a copy of a grain's settings as it is triggered, so the field
+// itself (and every pattern built from it) never has to be regenerated
+struct GrainScale {
+  float pitch = 1; // frequency ratio
+  float time = 1; // duration ratio
+
+  static GrainScale of(float semitones, float stretch) { return {powf(2.0f, semitones / 12.0f), stretch}; }
+  GrainScale operator*(const GrainScale& s) const { return {pitch * s.pitch, time * s.time}; }
+  bool operator==(const GrainScale& s) const { return pitch == s.pitch && time == s.time; }
+  bool identity() const { return pitch == 1 && time == 1; }
+  void apply(GrainParams& g) const {
+    g.transpose(pitch);
+    g.duration *= time;
+  }
+};
+
+struct GrainSettings : GrainParams {
+  al::Mesh mesh;
   al::Vec3f color = al::Vec3f(1.0, 1.0, 1.0);
 
   bool hover = false;
@@ -115,7 +100,6 @@ struct GrainSettings {
 
   void set(float cm, float csd, float mm, float msd, float md, float mdsd, float e, float g) {
     duration = al::rnd::uniform(0.01, double(MAX_DURATION)); //one second
-    size = map(duration, 0.01, double(MAX_DURATION), 0.5, 5.0);
     modulator_depth = md; 
     envelope = e;
     gain = g;
@@ -127,6 +111,12 @@ struct GrainSettings {
     md_start = mtof(al::clip((double)al::rnd::normal() / mdsd + (double)md, MAX_FREQUENCY, 0.0));
     md_end = mtof(al::clip((double)al::rnd::normal() / mdsd + (double)md, MAX_FREQUENCY, 0.0));
 
+    place();
+  }
+
+  // size and position in the field follow from the duration and the glides
+  void place() {
+    size = map(duration, 0.01, double(MAX_DURATION), 0.5, 5.0);
     float x = map((carrier_end - carrier_start), -127.0, 354.0, -2.0, 2.0);
     float y = map((modulator_end - modulator_start), -127.0, 354.0, -2.0, 2.0);
     float z = map((md_end - md_start), -127.0, 354.0, -2.0, 2.0); 
@@ -136,64 +126,386 @@ struct GrainSettings {
   }
 };
 
-struct Grain : al::SynthVoice {
-  gam::Sine<float> carrier; 
-  gam::Sine<float> modulator; 
-  Line moddepth; 
-  ExpSeg alpha;
-  ExpSeg beta;
-  AttackDecay envelope;
-
+// the sphere a sounding grain is drawn as. Built the first time it is drawn, on the graphics thread, so triggering
+// never allocates and voices that are never drawn (an offline render's) never build one
+struct GrainMesh {
   al::Mesh mesh;
+  bool built = false;
+
+  const al::Mesh& get() {
+    if (!built) {
+      mesh.primitive(al::Mesh::TRIANGLE_STRIP);
+      al::addSphere(mesh, 0.1);
+      mesh.generateNormals();
+      built = true;
+    }
+    return mesh;
+  }
+};
+
+// a two-operator FM chirplet: a modulator gliding under a carrier, both gliding, shaped by an envelope
+template <class Osc, class Glide, class Env = Envelope, class Out = BusOut>
+struct FMGrain : GrainVoice {
+  Osc carrier;
+  Osc modulator;
+  LinearGlide moddepth;
+  Glide alpha;
+  Glide beta;
+  Env envelope;
+
+  GrainMesh mesh;
   al::Vec3f position;
   al::Vec3f color = al::Vec3f(1.0, 0.0, 0.0);
   float size = 0.0;
 
-  Grain() { mesh.primitive(al::Mesh::TRIANGLE_STRIP); }
-
-  void set(GrainSettings g, float sequence_gain) {
+  void set(const GrainParams& g, float sequence_gain, int window) {
     size = g.size;
 
-    alpha.set(g.carrier_start, g.carrier_end, g.duration);
-    beta.set(g.modulator_start, g.modulator_end, g.duration);
-    carrier.freq(0);
-    modulator.freq(0);
+    envelope.set(window, g.envelope * g.duration, (1 - g.envelope) * g.duration, g.gain * sequence_gain, rate());
 
-    moddepth.set(g.md_start, g.md_end, g.duration); // set start freq, target freq, duration in seconds
+    alpha.set(g.carrier_start, g.carrier_end, envelope.length); // everything glides over the envelope's exact length
+    beta.set(g.modulator_start, g.modulator_end, envelope.length);
+    carrier.reset();
+    modulator.reset();
 
-    envelope.set(g.envelope * g.duration, (1 - g.envelope) * g.duration, g.gain * sequence_gain);
+    moddepth.set(g.md_start, g.md_end, envelope.length); // set start freq, target freq, duration in samples
 
-    al::addSphere(mesh, 0.1);
-    mesh.generateNormals();
     position = g.position;
   }
 
-  void onProcess(al::AudioIOData& io) override { // audio thread
-    while (io()) {
-      modulator.freq(beta());
-      carrier.freq(alpha() + moddepth() * modulator());
-      
-      float v = envelope() * carrier();
-      io.out(0) += v;
-      io.out(1) += v;
+  // highest frequency its sidebands reach, by Carson's rule: carrier + deviation + modulator
+  static float top(const GrainParams& g) {
+    return std::max(g.carrier_start, g.carrier_end) + std::max(g.md_start, g.md_end) + std::max(g.modulator_start, g.modulator_end);
+  }
+
+  float level() const override { return envelope.value; }
 
-      if (envelope.decay.done()) {
-        free();
-        break;
-      }
+  void render(SpatialBus& bus, int start) override { // audio thread or a render worker
+    const float r = rate();
+    const int end = start + (int)std::min((long)(bus.frames - start), envelope.remaining());
+    float* out = bus.scratch;
+    envelope.fill(out + start, end - start);
+    for (int t = start; t < end; t++) {
+      const float m = modulator(beta(), r);
+      out[t] *= carrier(alpha() + moddepth() * m, r); // mono, spread over the speakers below
     }
+    if (envelope.done()) free(); // exactly at the end of the envelope
+    Out::write(bus, gains, out, start, end);
   }
 
+  using GrainVoice::onProcess;
   void onProcess(al::Graphics &g) override { // graphics thread
     g.pushMatrix();
     g.translate(position);
     g.scale(size); // scale based on duration (normalized)
     g.color(color.x, color.y, color.z); // grain flashes red whenever it plays
-    g.draw(mesh);  // Draw the mesh
+    g.draw(mesh.get());  // Draw the mesh
+    g.popMatrix();
+  }
+};
+
+// the flavors the trigger path picks from; add one here and in Granulator::flavors
+using Grain = FMGrain<GammaSine, ExpGlide>; // the original chirplet
+using LinearGrain = FMGrain<GammaSine, LinearGlide>; // glides evenly in hz, so chirps bend the other way
+using CheapGrain = FMGrain<TableSine, ExpGlide>;
+using CheapLinearGrain = FMGrain<TableSine, LinearGlide>;
+
+// an FM grain of several operators, wired by one of the algorithms in operators.h
+template <class Alg>
+struct OperatorGrain : GrainVoice {
+  static_assert(Alg::N <= MAX_OPERATORS && Alg::N + 4 <= SpatialBus::LANES, "too many operators");
+
+  double phase[Alg::N] = {}; // in cycles; summed in double, since a block's worth of float adds drifts audibly
+  float feedback = 0; // last output of the feedback operator
+  ExpGlide alpha, beta; // carrier and modulator frequency
+  LinearGlide moddepth; // in hz, turned into an index against the modulator frequency
+  Envelope envelope; // also counts down the samples left to play
+
+  GrainMesh mesh;
+  al::Vec3f position;
+  al::Vec3f color = al::Vec3f(1.0, 0.0, 0.0);
+  float size = 0.0;
+
+  void set(const GrainParams& g, float sequence_gain, int window) {
+    envelope.set(window, g.envelope * g.duration, (1 - g.envelope) * g.duration, g.gain * sequence_gain, rate());
+    alpha.set(g.carrier_start, g.carrier_end, envelope.length);
+    beta.set(g.modulator_start, g.modulator_end, envelope.length);
+    moddepth.set(g.md_start, g.md_end, envelope.length);
+    std::fill(phase, phase + Alg::N, 0.0);
+    feedback = 0;
+    size = g.size;
+    position = g.position;
+  }
+
+  // highest frequency its sidebands reach (see reach in operators.h), at the largest index the glides play
+  static float top(const GrainParams& g) {
+    const float lowest = std::max(std::min(g.modulator_start, g.modulator_end), 1.0f);
+    const float index = std::min(std::max(g.md_start, g.md_end) / lowest, 8.0f);
+    return reach<Alg>(std::max(g.carrier_start, g.carrier_end), std::max(g.modulator_start, g.modulator_end), index);
+  }
+
+  float level() const override { return envelope.value; }
+
+  void render(SpatialBus& bus, int start) override { // audio thread or a render worker
+    const int n = (int)std::min((long)(bus.frames - start), envelope.remaining());
+    float* carrier = bus.lanes[0]; // cycles per sample
+    float* modulator = bus.lanes[1];
+    float* index = bus.lanes[2]; // modulation index, in cycles
+    float* env = bus.lanes[3];
+    const float period = 1 / rate();
+    for (int t = 0; t < n; t++) {
+      carrier[t] = alpha() * period;
+      const float fm = beta();
+      modulator[t] = fm * period;
+      index[t] = std::min(moddepth() / std::max(fm, 1.0f), 8.0f) / (2 * (float)M_PI); // FM index (deviation / fm) as a phase offset
+    }
+    envelope.fill(env, n);
+
+    constexpr int carriers = countBits(Alg::carriers);
+    float* out = bus.scratch + start;
+    std::fill(out, out + n, 0.0f);
+    for (int i = Alg::N - 1; i >= 0; i--) { // modulators before what they modulate
+      float* lane = bus.lanes[4 + i];
+      const bool isCarrier = (Alg::carriers >> i) & 1;
+      const float* hz = isCarrier ? carrier : modulator;
+      const float ratio = Alg::ratio[i];
+
+      double p = phase[i];
+      for (int t = 0; t < n; t++) { // the running phase is the only serial part, so it is just an add
+        lane[t] = (float)p;
+        p += ratio * hz[t];
+      }
+      phase[i] = p - floor(p); // wrapped once per block; sine() takes any phase
+
+      for (int j = i + 1; j < Alg::N; j++)
+        if ((Alg::mods[i] >> j) & 1) {
+          const float* m = bus.lanes[4 + j];
+          for (int t = 0; t < n; t++) lane[t] += m[t];
+        }
+
+      if (i == Alg::FEEDBACK) {
+        float y = feedback;
+        for (int t = 0; t < n; t++) lane[t] = y = sine(lane[t] + FEEDBACK_AMOUNT * y);
+        feedback = y;
+      } else {
+        for (int t = 0; t < n; t++) lane[t] = sine(lane[t]);
+      }
+
+      if (isCarrier) {
+        for (int t = 0; t < n; t++) out[t] += lane[t] * env[t] * (1.0f / carriers);
+      } else {
+        const float depth = Alg::depth[i];
+        for (int t = 0; t < n; t++) lane[t] *= depth * index[t];
+      }
+    }
+
+    if (envelope.done()) free();
+    bus.mix(gains, bus.scratch, start, start + n);
+  }
+
+  using GrainVoice::onProcess;
+  void onProcess(al::Graphics &g) override { // graphics thread
+    g.pushMatrix();
+    g.translate(position);
+    g.scale(size);
+    g.color(color.x, color.y, color.z);
+    g.draw(mesh.get());
     g.popMatrix();
   }
 };
 
+// a windowed stretch of a loaded sound file, read at a playback rate; triggered from the same settings as Grain
+struct SampleGrain : GrainVoice {
+  const float* data = nullptr; // owned by whoever loaded the file, outlives the voice
+  long frames = 0;
+  double index = 0, increment = 1; // read position and step, in samples
+  Interpolation interpolation = Interpolation::CUBIC;
+  Envelope envelope; // also counts down the samples left to play
+
+  GrainMesh mesh;
+  al::Vec3f position;
+  al::Vec3f color = al::Vec3f(1.0, 0.0, 0.0);
+  float size = 0.0;
+
+  void set(const GrainParams& g, float sequence_gain, int window, const float* source, long sourceFrames) {
+    size = g.size;
+    position = g.position;
+    data = source;
+    frames = sourceFrames;
+    index = g.onset * SAMPLE_RATE;
+    increment = g.rate;
+    envelope.set(window, g.envelope * g.duration, (1 - g.envelope) * g.duration, g.gain * sequence_gain);
+  }
+
+  float level() const override { return envelope.value; }
+
+  void render(SpatialBus& bus, int start) override { // audio thread or a render worker
+    float* out = bus.scratch;
+    const int n = (int)std::min((long)(bus.frames - start), envelope.remaining());
+    float* env = bus.lanes[0];
+    index = interpolate::read(data, frames, index, increment, n, out + start, interpolation);
+    envelope.fill(env, n);
+    for (int t = 0; t < n; t++) out[start + t] *= env[t];
+    if (envelope.done()) free();
+    bus.mix(gains, out, start, start + n);
+  }
+
+  using GrainVoice::onProcess;
+  void onProcess(al::Graphics &g) override { // graphics thread
+    g.pushMatrix();
+    g.translate(position);
+    g.scale(size);
+    g.color(color.x, color.y, color.z);
+    g.draw(mesh.get());
+    g.popMatrix();
+  }
+};
+
+// the voices and buses grains render through, without the field or its sliders: the live Granulator has one, and
+// every offline render (frozen loops, bounces) has its own, so those never touch the live voices or draw from the
+// field's random numbers
+struct GrainEngine {
+  // how an engine is set up, as plain values, so it can be copied into another thread
+  struct Config {
+    Spatializer::Mode mode = Spatializer::PAN;
+    SpeakerLayout layout = SpeakerLayout::stereo();
+    bool spatialize = false;
+    bool antialias = true;
+    bool subRate = true;
+    const float* sampleData = nullptr;
+    long sampleFrames = 0;
+  };
+
+  al::PolySynth polySynth; 
+  Spatializer spatializer; // encoding bus all grains render into, decoded to the speakers once per block
+  RenderQueue queue; // voices that are active this block
+  RenderWorkers workers; // threads that share the rendering when there are many voices
+  MultiRateBus rates; // oversampled and sub-rate buses, brought back into the encoding bus every block
+  QualityGovernor governor; // lowers quality instead of dropping out when the callback runs long
+  // the grain options, read as grains are triggered; the Granulator copies its sliders here every block
+  std::atomic<bool> spatialize{false};
+  std::atomic<bool> antialias{true};
+  std::atomic<bool> subRate{true};
+  const float* sampleData = nullptr; // the loaded source file sample grains read from
+  long sampleFrames = 0;
+
+  explicit GrainEngine(int polyphony) {
+    polySynth.allocatePolyphony<Grain>(polyphony); //this handles all grains that can happen at once
+    polySynth.allocatePolyphony<LinearGrain>(polyphony);
+    polySynth.allocatePolyphony<CheapGrain>(polyphony);
+    polySynth.allocatePolyphony<CheapLinearGrain>(polyphony);
+    polySynth.allocatePolyphony<OperatorGrain<Stack3>>(polyphony);
+    polySynth.allocatePolyphony<OperatorGrain<Stack4>>(polyphony);
+    polySynth.allocatePolyphony<OperatorGrain<TwoPairs>>(polyphony);
+    polySynth.allocatePolyphony<OperatorGrain<Branch>>(polyphony);
+    polySynth.allocatePolyphony<OperatorGrain<DX1>>(polyphony);
+    polySynth.allocatePolyphony<OperatorGrain<Organ>>(polyphony);
+    polySynth.allocatePolyphony<SampleGrain>(MAX_GRAINS); // sample grains are cheap, so keep plenty ready
+  }
+
+  // how many octaves above (or below) SAMPLE_RATE a grain whose sidebands reach top renders at: high enough that it
+  // doesn't alias, and as low as its bandwidth allows, which makes low grains two or four times cheaper
+  int rateShift(float top) const {
+    if (top >= 0.45f * SAMPLE_RATE) return !antialias ? 0 : (top < 0.9f * SAMPLE_RATE) ? 1 : MAX_OVERSAMPLE_SHIFT;
+    if (!subRate) return 0;
+    // under a third of the lower rate, where the filters are flat and the sidebands past Carson's estimate still fit
+    if (top < 0.08f * SAMPLE_RATE) return -MAX_UNDERSAMPLE_SHIFT;
+    return (top < 0.16f * SAMPLE_RATE) ? -1 : 0;
+  }
+
+  template <class V> void set(V* voice, const GrainParams& settings, float gain, int window) {
+    voice->rateShift = rateShift(V::top(settings)); // each voice kind knows how far its sidebands reach
+    voice->set(settings, gain, window);
+    voice->queue = &queue;
+    spatializer.encode(settings.position, spatialize, voice->gains);
+  }
+
+  template <class V> bool play(const GrainParams& settings, float gain, int window, int offset) {
+    auto* voice = polySynth.getVoice<V>(); // grab one of the voices
+    if (voice == nullptr) return false;
+    set(voice, settings, gain, window);
+    polySynth.triggerOn(voice, offset); //trigger it on, offset frames into the next block
+    return true;
+  }
+
+  // FM flavors by [cheap oscillators][glide]
+  typedef bool (GrainEngine::*Play)(const GrainParams&, float, int, int);
+  static constexpr Play flavors[2][2] = {
+    {&GrainEngine::play<Grain>, &GrainEngine::play<LinearGrain>},
+    {&GrainEngine::play<CheapGrain>, &GrainEngine::play<CheapLinearGrain>},
+  };
+  // multi-operator flavors by GrainSettings::algorithm - 1
+  static constexpr Play algorithms[NUM_ALGORITHMS] = {
+    &GrainEngine::play<OperatorGrain<Stack3>>, &GrainEngine::play<OperatorGrain<Stack4>>,
+    &GrainEngine::play<OperatorGrain<TwoPairs>>, &GrainEngine::play<OperatorGrain<Branch>>,
+    &GrainEngine::play<OperatorGrain<DX1>>, &GrainEngine::play<OperatorGrain<Organ>>,
+  };
+
+  void set(SampleGrain* voice, const GrainParams& settings, float gain, int window) { // overloads the template above
+    voice->rateShift = 0;
+    voice->set(settings, gain, window, sampleData, sampleFrames);
+    voice->queue = &queue;
+    voice->interpolation = governor.cheapOscillators() ? Interpolation::LINEAR : Interpolation::CUBIC;
+    spatializer.encode(settings.position, spatialize, voice->gains);
+  }
+
+  // see Granulator::trigger
+  bool trigger(const GrainParams& settings, float gain, bool hover = false, int window = -1, int offset = 0, const GrainScale& scale = GrainScale()) {
+    if (!governor.allowTrigger(hover)) return false;
+    if (window < 0) window = settings.window;
+    if (scale.identity()) return dispatch(settings, gain, window, offset);
+    GrainParams scaled = settings; // a copy on the stack; the field keeps its own settings
+    scale.apply(scaled);
+    return dispatch(scaled, gain, window, offset);
+  }
+
+  bool dispatch(const GrainParams& settings, float gain, int window, int offset) { // the voice that plays it
+    if (settings.type == GrainParams::SAMPLE && sampleFrames > 0) return play<SampleGrain>(settings, gain, window, offset);
+    if (settings.algorithm > 0 && settings.algorithm <= NUM_ALGORITHMS) return (this->*algorithms[settings.algorithm - 1])(settings, gain, window, offset);
+    return (this->*flavors[governor.cheapOscillators()][settings.glide == GrainParams::LINEAR_GLIDE])(settings, gain, window, offset);
+  }
+
+  // not real-time safe; call before audio starts
+  void configure(Spatializer::Mode mode, const SpeakerLayout& layout, int threads) {
+    spatializer.configure(mode, layout);
+    workers.start(threads, spatializer.bus.channels);
+    rates.resize(spatializer.bus.channels, true);
+  }
+
+  // set up like config says, rendering on the calling thread only; not real-time safe. Grains still sounding
+  // are let go and the converters start from silence
+  void configure(const Config& config) {
+    for (al::SynthVoice* v = polySynth.getActiveVoices(); v != nullptr; v = v->next) v->free();
+    configure(config.mode, config.layout, 0);
+    spatialize = config.spatialize;
+    antialias = config.antialias;
+    subRate = config.subRate;
+    source(config.sampleData, config.sampleFrames);
+  }
+
+  // the file sample grains play from; it must stay loaded while the engine runs
+  void source(const float* data, long frames) {
+    sampleData = data;
+    sampleFrames = frames;
+  }
+
+  // every active voice into the encoding bus, which is left undecoded for whatever else plays under the grains
+  void renderVoices(al::AudioIOData& io) {
+    spatializer.clear(io.framesPerBuffer());
+    rates.clear(io.framesPerBuffer());
+    queue.clear();
+    polySynth.render(io); // every active grain queues itself with the frame it starts on
+    governor.enforce(queue);
+    workers.render(queue, spatializer.bus, rates); // ...and is rendered into the encoding bus here
+    rates.resolve(spatializer.bus); // grains at other rates join it once they are back at SAMPLE_RATE
+  }
+
+  void render(al::AudioIOData& io) {
+    renderVoices(io);
+    spatializer.decode(io);
+  }
+};
+
 struct Granulator {
   // GUI accessible parameters
   al::ParameterInt nGrains{"/number of grains", "", 100, "", 0, MAX_GRAINS}; // user input for number of grains on-screen
@@ -205,21 +517,65 @@ struct Granulator {
   al::Parameter moddepth_stdv{"/modulation depth standard deviation", "", 0.07, "", 0.01, 1.0}; // user input for standard deviation value of modulation depth
   al::Parameter envelope{"/envelope", "", 0.5, "", 0.01, 1.0}; // user input for volume of the playing program. starts at 0 for no sound.
   al::Parameter gain{"/gain", "", 0.5, "", 0.0, 1.0}; // user input for volume of the playing program. starts at 0 for no sound.
-
-  al::PolySynth polySynth; 
+  al::ParameterBool spatialize{"/spatialize", "", 0.0}; // place grains around the listener by their position in the field
+  al::ParameterBool workStealing{"/work stealing", "", 1.0}; // balance render workers by stealing chunks of grains, or split statically
+  al::ParameterInt window{"/window", "", TRIANGLE, "", 0, NUM_WINDOWS - 1}; // envelope shape: triangle, hann, gaussian, tukey, exponential decay
+  al::ParameterBool linearGlide{"/linear glide", "", 0.0}; // glide evenly in hz instead of evenly in pitch
+  al::ParameterInt algorithm{"/fm algorithm", "", 0, "", 0, NUM_ALGORITHMS}; // 0 is the original two-operator grain
+  al::ParameterBool antialias{"/antialias", "", 1.0}; // oversample the grains whose sidebands would pass nyquist
+  al::ParameterBool subRate{"/sub-rate grains", "", 1.0}; // render narrow-band grains at 1/2 or 1/4 rate
+  al::Parameter transpose{"/transpose", "", 0.0, "", -24.0, 24.0}; // semitones, for every grain as it plays
+  al::Parameter timeScale{"/time scale", "", 1.0, "", 0.25, 4.0}; // grain durations times this, as they play
+  al::Parameter sampleMix{"/sample grains", "", 0.0, "", 0.0, 1.0}; // share of the field that plays the source file instead of FM, on the next reset
+
+  GrainEngine engine{nGrains}; // the voices and buses the grains render through
+  TimeStretch stretcher; // plays the source file stretched and pitch shifted, under the grains
   std::vector<GrainSettings> settings;
   
   Granulator() { 
     for (int i = 0; i < MAX_GRAINS; i++) { // push back all of the different settings for MAX_GRAINS at the start of the program
       GrainSettings g;
       g.set(carrier_mean, carrier_stdv, modulator_mean, modulator_stdv, modulation_depth, moddepth_stdv, envelope, gain);
+      g.id = i;
       settings.push_back(g);
     }
-    polySynth.allocatePolyphony<Grain>(nGrains); //this handles all grains that can happen at once
   } 
 
-  void set(Grain* voice, GrainSettings settings, float gain) {
-    voice->set(settings, gain);
+  // audio thread, every block: hand the sliders the voices read to the engine
+  void sync() {
+    engine.spatialize = spatialize;
+    engine.antialias = antialias;
+    engine.subRate = subRate;
+    engine.workers.stealing = (bool)workStealing;
+  }
+
+  // how an offline engine should be set up to sound like this one; graphics thread, so it reads the sliders
+  // rather than the engine's copies of them
+  GrainEngine::Config config() const {
+    return {engine.spatializer.mode, engine.spatializer.layout, (bool)spatialize, (bool)antialias, (bool)subRate, engine.sampleData, engine.sampleFrames};
+  }
+
+  // the transpose and time scale sliders as factors; worked out once per block, not per grain
+  GrainScale scaling() const { return GrainScale::of(transpose, timeScale); }
+
+  // the one place grains are triggered from; false when the governor turned the trigger down.
+  // window overrides the grain's own envelope shape when it isn't negative (a sequencer's choice, say);
+  // the grain starts offset frames into the next block rendered, transposed and stretched by scale
+  bool trigger(const GrainParams& settings, float gain, bool hover = false, int window = -1, int offset = 0, const GrainScale& scale = GrainScale()) {
+    return engine.trigger(settings, gain, hover, window, offset, scale);
+  }
+
+  // not real-time safe; call before audio starts
+  void configure(Spatializer::Mode mode, const SpeakerLayout& layout, int threads) { engine.configure(mode, layout, threads); }
+
+  // the file sample grains play from; it must stay loaded while the granulator runs
+  void source(const float* data, long frames) { engine.source(data, frames); }
+
+  void render(al::AudioIOData& io) { // audio thread
+    sync();
+    engine.renderVoices(io);
+    stretcher.render(engine.sampleData, engine.sampleFrames, engine.spatializer, spatialize);
+    engine.spatializer.decode(io);
   }
 
   void displayGrainSettings(al::Graphics &g) {
@@ -237,6 +593,16 @@ struct Granulator {
     // whenever the user hits the spacebar, reset grain settings based on the new slider parameters
     for (int i = 0; i < MAX_GRAINS; i++) {
       settings[i].set(carrier_mean, carrier_stdv, modulator_mean, modulator_stdv, modulation_depth, moddepth_stdv, envelope, gain);
+      settings[i].window = window;
+      settings[i].glide = linearGlide ? GrainSettings::LINEAR_GLIDE : GrainSettings::EXP_GLIDE;
+      settings[i].algorithm = algorithm;
+      if (engine.sampleFrames > 0 && al::rnd::uniform() < sampleMix) { // a stretch of the source, pitched by the carrier draw
+        settings[i].type = GrainSettings::SAMPLE;
+        settings[i].onset = al::rnd::uniform(0.0, (double)engine.sampleFrames / SAMPLE_RATE);
+        settings[i].rate = settings[i].carrier_start / mtof(carrier_mean);
+      } else {
+        settings[i].type = GrainSettings::FM;
+      }
     }
   }
 };
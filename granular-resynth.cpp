@@ -16,17 +16,33 @@
 #include "al/math/al_Random.hpp"
 #include "grains.h"
 #include "sequence.h"
+#include "freeze.h"
 #include "buffer.h"
+#include "analysis.h"
+#include "session.h"
+#include "bounce.h"
 
 using namespace al;
 
 struct MyApp : App {
   ControlGUI gui; // gui
   Granulator granulator; // handles grains
-  std::vector<Sequencer> sequencers;
+  std::vector<std::unique_ptr<Sequencer>> sequencers; // by slot; a destroyed sequencer leaves its slot empty for the next one
+  std::vector<std::unique_ptr<LoopFreezer>> freezers; // pre-rendered cycles for the sequencers with freeze checked, same slots
+  SequencerControls controls; // the GUI's view of the selected sequencer
+  StepControls stepControls; // ...and of its focused step
+  int selected = -1; // the sequencer clicks add grains to, -1 for none
+  Transport transport; // the one clock every sequencer steps on
   std::mutex mutex; // mutex for audio callback
+  LoopFreezer* mixing[MAX_SEQUENCERS]; // audio thread: the freezers it mixes, refreshed whenever it gets the mutex, so
+  int mixCount = 0;                    // frozen loops keep playing (and keep time) through blocks it doesn't
+  std::atomic<long> refreshes{0}; // how many times mixing was refreshed
+  std::vector<std::pair<long, std::unique_ptr<LoopFreezer>>> retiring; // destroyed, with refreshes as of then; deleted
+                                                                       // once mixing has been refreshed without them
   al::Light light; // light source for shading
   Buffer recorder;
+  MappedBuffer source; // what sample grains play from
+  std::string sessionFile = "session.txt"; // where k saves the session, and where --session loaded it from
 
   MyApp() {}
 
@@ -36,14 +52,17 @@ struct MyApp : App {
            granulator.carrier_mean << granulator.carrier_stdv << 
            granulator.modulator_mean << granulator.modulator_stdv << 
            granulator.modulation_depth << granulator.moddepth_stdv <<
-           granulator.envelope; 
+           granulator.envelope << granulator.spatialize << granulator.workStealing << granulator.sampleMix << granulator.window << granulator.linearGlide << granulator.algorithm << granulator.antialias << granulator.subRate <<
+           granulator.transpose << granulator.timeScale;
+    gui << granulator.stretcher.gain << granulator.stretcher.stretch << granulator.stretcher.pitch <<
+           granulator.stretcher.grainSize << granulator.stretcher.streams;
            
-    for (int i = 0; i < NUM_SEQUENCERS; i++) {  // init sequencers
-      Sequencer s; 
-      sequencers.push_back(s); 
-    } 
-    
-    for (int i = 0; i < NUM_SEQUENCERS; i++) { gui << sequencers[i].rate << sequencers[i].gain; } // add their rates to the GUI
+    if (sequencers.empty()) for (int i = 0; i < NUM_SEQUENCERS; i++) createSequencer(); // init sequencers, more can be added with n
+
+    gui << transport.tempo << controls.rate << controls.gain << controls.window << controls.freeze <<
+           controls.transpose << controls.timeScale; // the selected sequencer's controls
+    gui << stepControls.probability << stepControls.ratchets << stepControls.nudge << stepControls.gain <<
+           stepControls.transpose << stepControls.envelope << stepControls.window; // and its focused step's
     
     nav().pos(0, 0, 25);
     light.pos(0, 0, 25);
@@ -53,8 +72,75 @@ struct MyApp : App {
   void onAnimate(double dt) override {
     navControl().active(!gui.usingInput());
 
-    for (int i = 0; i < NUM_SEQUENCERS; i++) {
-      sequencers[i].setTimer(); // check if timers need to be reset
+    controls.sync(selected >= 0 ? sequencers[selected].get() : nullptr);
+    stepControls.sync(selected >= 0 ? sequencers[selected].get() : nullptr);
+    for (int i = 0; i < sequencers.size(); i++) {
+      if (!sequencers[i]) continue;
+      sequencers[i]->update(); // compile its steps for the audio thread if they changed
+      freezers[i]->update(*sequencers[i], transport, granulator); // render a frozen cycle in the background if it's due
+    }
+    for (size_t i = 0; i < retiring.size();) { // the audio thread has let go of these once it refreshed mixing
+      if (refreshes > retiring[i].first) retiring.erase(retiring.begin() + i);
+      else i++;
+    }
+    granulator.engine.governor.printChanges();
+    granulator.engine.queue.printDrops();
+  }
+
+  int createSequencer() { // graphics thread; returns its slot, or -1 when every slot is taken
+    mutex.lock();
+    int slot = 0;
+    while (slot < sequencers.size() && sequencers[slot]) slot++;
+    if (slot == MAX_SEQUENCERS) {
+      mutex.unlock();
+      return -1;
+    }
+    if (slot == sequencers.size()) {
+      sequencers.emplace_back();
+      freezers.emplace_back();
+    }
+    sequencers[slot] = std::make_unique<Sequencer>(slot);
+    freezers[slot] = std::make_unique<LoopFreezer>();
+    mutex.unlock();
+    return slot;
+  }
+
+  void destroySequencer(int slot) { // graphics thread
+    if (slot < 0 || slot >= sequencers.size() || !sequencers[slot]) return;
+    mutex.lock();
+    std::unique_ptr<Sequencer> s = std::move(sequencers[slot]);
+    retiring.emplace_back(refreshes.load(), std::move(freezers[slot])); // the audio thread may still be mixing it
+    mutex.unlock(); // the sequencer is deleted out here and the freezer in onAnimate, where waiting on a background render doesn't hold up the audio
+    for (auto& member : s->members) granulator.settings[member.first].color = al::Vec3f(1.0, 1.0, 1.0);
+    if (selected == slot) selected = -1;
+    controls.shown = nullptr; // a new sequencer could land at the same address, and must load the controls, not take them
+    stepControls.shown = nullptr;
+    stepControls.step = -1;
+  }
+
+  bool loadSession(const std::string& fileName) { // before audio starts
+    sessionFile = fileName;
+    if (!Session{granulator, sequencers, transport}.load(fileName.c_str())) return false;
+    freezers.clear();
+    for (auto& s : sequencers) freezers.push_back(s ? std::make_unique<LoopFreezer>() : nullptr);
+    return true;
+  }
+
+  void saveSession() { // graphics thread; the audio thread never touches what it reads
+    if (Session{granulator, sequencers, transport}.save(sessionFile.c_str())) printf("saved session to %s\n", sessionFile.c_str());
+  }
+
+  void select(int slot) { // graphics thread; -1 or an empty slot selects nothing
+    const int previous = selected;
+    selected = (slot >= 0 && slot < sequencers.size() && sequencers[slot]) ? slot : -1;
+    if (selected >= 0 && selected != previous) sequencers[selected]->focus = -1; // the step controls wait for , or . or a new step
+  }
+
+  void selectNext(int direction) { // cycle through the live sequencers
+    const int n = sequencers.size();
+    for (int k = 1; k <= n; k++) {
+      const int slot = ((selected < 0 ? (direction > 0 ? -1 : 0) : selected) + direction * k + 2 * n) % n;
+      if (sequencers[slot]) { select(slot); return; }
     }
   }
 
@@ -89,22 +175,10 @@ struct MyApp : App {
     for (int i = 0; i < granulator.nGrains; i++) {
       float t = r.intersectSphere(granulator.settings[i].position, 0.2);
 
-      if (t > 0.0f) {
-        mutex.lock();
-        for (int j = 0; j < NUM_SEQUENCERS; j++) {
-          //sequencers[j].sayName();
-          if (sequencers[j].active) {
-            bool found = sequencers[j].checkIntersection(granulator.settings[i].position); 
-
-            if (!found) {
-              granulator.settings[i].color = sequencers[j].color; // turn it whatever color is assigned to the sequencer
-              sequencers[j].addSample(granulator.settings[i]);
-              //sequencers[j].printSamples();
-              break;
-            } else { granulator.settings[i].color = al::Vec3f(1.0, 1.0, 1.0); } // turn it white again 
-          }
-        }
-        mutex.unlock();
+      if (t > 0.0f && selected >= 0) { // no lock; the audio thread only sees the steps once they are compiled
+        Sequencer& s = *sequencers[selected];
+        if (s.toggle(granulator.settings[i])) { granulator.settings[i].color = s.color; } // turn it whatever color is assigned to the sequencer
+        else { granulator.settings[i].color = al::Vec3f(1.0, 1.0, 1.0); } // turn it white again 
       }
     }
     return true;
@@ -116,10 +190,8 @@ struct MyApp : App {
       float t = r.intersectSphere(granulator.settings[i].position, 0.1);
       // only trigger once; no re-trigger when hovering
       if (granulator.settings[i].hover == false && t > 0.0f) {
-        // trigger grain
-        auto* voice = granulator.polySynth.getVoice<Grain>(); // grab one of the voices
-        granulator.set(voice, granulator.settings[i], granulator.envelope); // set properties of the voice -> taken from settings[playhead index]
-        granulator.polySynth.triggerOn(voice); //trigger it on
+        // trigger grain, unless the governor is shedding hover triggers
+        granulator.trigger(granulator.settings[i], granulator.envelope, true, -1, 0, granulator.scaling());
       }
       granulator.settings[i].hover = (t > 0.f);
     }
@@ -129,11 +201,18 @@ struct MyApp : App {
   virtual bool onKeyDown(const Keyboard &k) override {
     if (k.key() == ' ') {
       granulator.resetSettings();
-    } else {
-      for (int i = 0; i < sequencers.size(); i++) {
-        if (k.key() - 48 - 1 == i) { sequencers[i].enable(); }
-        else { sequencers[i].disable(); }
-      }
+    } else if (k.key() == 'k') { // keep the field and the sequencers, for later or for rendering offline
+      saveSession();
+    } else if (k.key() == 'n') { // a new sequencer, selected
+      select(createSequencer());
+    } else if (k.key() == Keyboard::BACKSPACE || k.key() == Keyboard::DELETE) {
+      destroySequencer(selected);
+    } else if (k.key() == '[' || k.key() == ']') {
+      selectNext(k.key() == ']' ? 1 : -1);
+    } else if ((k.key() == ',' || k.key() == '.') && selected >= 0) { // focus the step before or after for the step controls
+      sequencers[selected]->focusNext(k.key() == '.' ? 1 : -1);
+    } else if (k.key() >= '1' && k.key() <= '9') {
+      select(k.key() - '1');
     }
     
     return true;
@@ -145,41 +224,120 @@ struct MyApp : App {
     g.lighting(true);
     gui.draw(g); // draw GUI
     granulator.displayGrainSettings(g); // render all the grain settings
-    granulator.polySynth.render(g);  // call render for PolySynth to generate its output
+    granulator.engine.polySynth.render(g);  // call render for PolySynth to generate its output
   }
 
   void onSound(AudioIOData& io) override {    
-    granulator.polySynth.render(io); // render all active synth voices (grains) into the output buffer
-    io.frame(0); // reset the frame so we can go over the frame again below
-
-    while (io()) {
-      for (int i = 0; i < NUM_SEQUENCERS; i++) {
-        if (sequencers[i].timer()) {
-          if (mutex.try_lock()) {
-            if (sequencers[i].sequence.size() > 0) { // if there is something in the sequence
-              auto* voice = granulator.polySynth.getVoice<Grain>(); // grab one of the voices
-              granulator.set(voice, sequencers[i].grabSample(), sequencers[i].gain); // set properties of the voice based on where we are in the sequencer
-              granulator.polySynth.triggerOn(voice); //trigger it on
-
-              sequencers[i].increment(); // increment the playhead of the sequencer
-            }
-            mutex.unlock();
+    granulator.engine.governor.begin();
+    if (mutex.try_lock()) {
+      const int frames = io.framesPerBuffer();
+      transport.schedule(sequencers, frames); // every sequencer's steps in this block, in order
+      const long long now = transport.now - frames; // where this block starts on the transport
+      const GrainScale global = granulator.scaling();
+      for (int i = 0; i < sequencers.size(); i++) {
+        if (!sequencers[i]) continue;
+        Sequencer& s = *sequencers[i];
+        s.scale = s.scaling(global); // transpose and time scale for every grain it starts this block
+        s.pattern.pickUp(); // the newest compiled steps
+        freezers[i]->check(s, transport); // frozen loops go stale as soon as their sequencer is edited
+        s.pattern.flush(now, frames, [&](const PatternEvent& e, int offset) { play(s, e, offset); }); // ratchets and nudges left over from earlier blocks
+      }
+      for (int e = 0; e < transport.count; e++) {
+        const TransportEvent& event = transport.events[e];
+        Sequencer& s = *sequencers[event.sequencer];
+        LoopFreezer& freezer = *freezers[event.sequencer];
+        if (s.pattern.steps() > 0) { // if there is something in the sequence
+          if (!freezer.check(s, transport)) { // each of the step's events starts on its exact frame, if its roll comes up
+            s.pattern.tick(now + event.offset, s.clock.interval, now, frames, [&](const PatternEvent& e, int offset) { play(s, e, offset); });
+          } else if (s.pattern.atTop()) {
+            freezer.start(event.offset); // the whole cycle comes from the frozen loop
           }
+          s.pattern.advance(); // increment the playhead of the sequencer
         }
       }
+      mixCount = 0;
+      for (int i = 0; i < sequencers.size(); i++) if (sequencers[i]) mixing[mixCount++] = freezers[i].get();
+      refreshes++;
+      mutex.unlock();
+    } else {
+      transport.skip(io.framesPerBuffer());
+    }
+    for (int i = 0; i < mixCount; i++) mixing[i]->mix(io); // frozen cycles, under the grains; a missed lock doesn't skip them
+    granulator.render(io); // render all active synth voices (grains) into the output buffer
+    io.frame(0); // reset the frame so we can go over the frame again below
 
-      recorder(0.5f * (io.out(0) + io.out(1))); // save to the buffer before we take into consideration the gain slider
-      io.out(0) = tanh(io.out(0) * granulator.gain);
-      io.out(1) = tanh(io.out(1) * granulator.gain);
+    while (io()) {
+      float mix = 0;
+      for (int c = 0; c < io.channelsOut(); c++) {
+        mix += io.out(c);
+        io.out(c) = tanh(io.out(c) * granulator.gain);
+      }
+      recorder(mix / io.channelsOut()); // save to the buffer before we take into consideration the gain slider
     }
+    granulator.engine.governor.end(io.framesPerBuffer());
+  }
+
+  void play(const Sequencer& s, const PatternEvent& e, int offset) { // audio thread; locks win over the sequencer's own settings
+    granulator.trigger(e.settings, e.gain >= 0 ? e.gain : s.gain, false, e.window >= 0 ? e.window : s.window, offset, s.scale);
   }
 
-  void onExit() override { recorder.save("fm-grains.wav"); }
+  void onExit() override {
+    recorder.save("fm-grains.wav");
+    granulator.engine.workers.staticStats.print("static split");
+    granulator.engine.workers.stealingStats.print("work stealing");
+  }
 };
 
-int main() {
+int main(int argc, char* argv[]) {
+  // usage: granular-resynth [--analyze source.wav] [--source samples.wav] [--session session.txt]
+  //                          [--render seconds [--out bounce.wav] [--stems] [--threads n] [--seed n]]
+  //                          [output channels] [pan | vbap | ambi1 | ambi3] [speaker layout file]
+  std::vector<std::string> args;
+  std::string source, samples, session, out = "bounce.wav";
+  double seconds = 0;
+  bool stems = false;
+  int threads = 1;
+  uint32_t seed = 0;
+  for (int i = 1; i < argc; i++) {
+    if (std::string(argv[i]) == "--analyze" && i + 1 < argc) source = argv[++i];
+    else if (std::string(argv[i]) == "--source" && i + 1 < argc) samples = argv[++i];
+    else if (std::string(argv[i]) == "--session" && i + 1 < argc) session = argv[++i];
+    else if (std::string(argv[i]) == "--render" && i + 1 < argc) seconds = atof(argv[++i]);
+    else if (std::string(argv[i]) == "--out" && i + 1 < argc) out = argv[++i];
+    else if (std::string(argv[i]) == "--stems") stems = true;
+    else if (std::string(argv[i]) == "--threads" && i + 1 < argc) threads = atoi(argv[++i]);
+    else if (std::string(argv[i]) == "--seed" && i + 1 < argc) seed = (uint32_t)strtoul(argv[++i], nullptr, 10);
+    else args.push_back(argv[i]);
+  }
+
+  int channels = (args.size() > 0) ? al::clip(atoi(args[0].c_str()), MAX_OUTPUT_CHANNELS, 1) : OUTPUT_CHANNELS;
+  Spatializer::Mode mode = (channels == 2) ? Spatializer::PAN : Spatializer::VBAP;
+  if (args.size() > 1 && !Spatializer::parseMode(args[1], mode)) printf("unknown spatializer %s, using the default\n", args[1].c_str());
+  SpeakerLayout layout = SpeakerLayout::ring(channels);
+  if (args.size() > 2 && layout.load(args[2].c_str())) channels = layout.size();
+
+  if (seconds > 0) { // render the session's sequencers and stretch layer offline and quit, without a window or a sound card
+    if (session.empty()) {
+      printf("--render needs a --session to play\n");
+      return 1;
+    }
+    Granulator granulator;
+    Transport transport;
+    std::vector<std::unique_ptr<Sequencer>> sequencers;
+    MappedBuffer sampleSource;
+    granulator.configure(mode, layout, 0);
+    if (!samples.empty() && sampleSource.load(samples)) granulator.source(sampleSource.data(), sampleSource.size());
+    if (!Session{granulator, sequencers, transport}.load(session.c_str())) return 1;
+    if (threads < 1) threads = std::thread::hardware_concurrency();
+    return Bounce::render(granulator, sequencers, transport, seconds, out, stems, threads, seed) ? 0 : 1;
+  }
+
   MyApp app;
+  app.granulator.configure(mode, layout, std::thread::hardware_concurrency() - 1); // one render worker per spare core
+  if (!source.empty()) resynthesize(app.granulator, source.c_str()); // grains fitted to the source instead of random ones
+  if (!samples.empty() && app.source.load(samples)) app.granulator.source(app.source.data(), app.source.size());
+  if (!session.empty()) app.loadSession(session); // on top of the analysis, if both are given
   app.dimensions(1400, 800);
-  app.configureAudio(SAMPLE_RATE, 768, OUTPUT_CHANNELS);
+  app.configureAudio(SAMPLE_RATE, 768, channels);
   app.start();
 }
\ No newline at end of file
@@ -0,0 +1,196 @@
+/* interpolate.h written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file defines the block read that sample-based grains use to play a stretch of a Buffer (or MappedBuffer)
+ * at a fractional rate: read(data, size, start, increment, count, out, interpolation) writes
+ * out[k] = x(start + k * increment), with x repeating forever to the left and right like Buffer::get.
+ * Instead of wrapping every sample, the block is cut into runs that stay clear of the ends, which go through
+ * branch-free linear, cubic Hermite or 8-tap windowed sinc kernels; only the few samples near a wrap are
+ * handled one at a time. Linear and cubic runs work out four positions at once with SSE2 (the taps are still
+ * loaded one by one, there is no gather before AVX2), sinc runs are a simd::dot per sample.
+ */
+
+# pragma once
+
+#include <algorithm>
+#include <cmath>
+#include "simd.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+enum class Interpolation { LINEAR, CUBIC, SINC };
+
+namespace interpolate {
+
+const int SINC_TAPS = 8;
+const int SINC_PHASES = 256; // fractional positions in the sinc table, rounded to the nearest
+
+// one row of SINC_TAPS coefficients per phase; row p is for the fraction p / SINC_PHASES
+inline const float* sincTable() {
+  static float* table = [] {
+    static float t[(SINC_PHASES + 1) * SINC_TAPS];
+    for (int p = 0; p <= SINC_PHASES; p++) {
+      double sum = 0;
+      for (int k = 0; k < SINC_TAPS; k++) {
+        const double d = k - SINC_TAPS / 2 + 1 - (double)p / SINC_PHASES;
+        const double x = M_PI * 0.9 * d;
+        const double sinc = (fabs(x) < 1e-9) ? 1.0 : sin(x) / x;
+        const double w = 0.5 + 0.5 * cos(M_PI * d / (SINC_TAPS / 2)); // Hann
+        t[p * SINC_TAPS + k] = (float)(sinc * w);
+        sum += t[p * SINC_TAPS + k];
+      }
+      for (int k = 0; k < SINC_TAPS; k++) t[p * SINC_TAPS + k] /= (float)sum;
+    }
+    return t;
+  }();
+  return table;
+}
+
+// taps a kernel needs before and after floor(position)
+inline int before(Interpolation interpolation) {
+  return interpolation == Interpolation::SINC ? SINC_TAPS / 2 - 1 : interpolation == Interpolation::CUBIC ? 1 : 0;
+}
+inline int after(Interpolation interpolation) {
+  return interpolation == Interpolation::SINC ? SINC_TAPS / 2 : interpolation == Interpolation::CUBIC ? 2 : 1;
+}
+
+inline float hermite(float t, float y0, float y1, float y2, float y3) {
+  const float c1 = 0.5f * (y2 - y0);
+  const float c2 = y0 - 2.5f * y1 + 2 * y2 - 0.5f * y3;
+  const float c3 = 0.5f * (y3 - y0) + 1.5f * (y1 - y2);
+  return ((c3 * t + c2) * t + c1) * t + y1;
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+// positions start + (k .. k + 3) * increment, split into indices and fractions four at a time; the same double
+// arithmetic as the scalar loops, so both give the same samples
+inline __m128 positions(double start, double increment, int k, int* index) {
+  const __m128d s = _mm_set1_pd(start), step = _mm_set1_pd(increment);
+  const __m128d p01 = _mm_add_pd(s, _mm_mul_pd(_mm_set_pd(k + 1, k), step));
+  const __m128d p23 = _mm_add_pd(s, _mm_mul_pd(_mm_set_pd(k + 3, k + 2), step));
+  const __m128i i01 = _mm_cvttpd_epi32(p01), i23 = _mm_cvttpd_epi32(p23); // truncated, in the low two lanes
+  _mm_storeu_si128((__m128i*)index, _mm_unpacklo_epi64(i01, i23));
+  const __m128d f01 = _mm_sub_pd(p01, _mm_cvtepi32_pd(i01)), f23 = _mm_sub_pd(p23, _mm_cvtepi32_pd(i23));
+  return _mm_movelh_ps(_mm_cvtpd_ps(f01), _mm_cvtpd_ps(f23));
+}
+
+inline __m128 taps(const float* data, const int* index, int offset) {
+  return _mm_setr_ps(data[index[0] + offset], data[index[1] + offset], data[index[2] + offset], data[index[3] + offset]);
+}
+#endif
+
+// the first samples of a linear or cubic run, four at a time; returns how many it wrote
+inline int runVector(const float* data, double start, double increment, int count, float* out, Interpolation interpolation) {
+  int k = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+  if (std::max(start, start + (count - 1) * increment) >= 2147483647.0) return 0; // indices past 32 bits
+  int index[4];
+  if (interpolation == Interpolation::LINEAR) {
+    for (; k + 4 <= count; k += 4) {
+      const __m128 t = positions(start, increment, k, index);
+      const __m128 y0 = taps(data, index, 0), y1 = taps(data, index, 1);
+      _mm_storeu_ps(out + k, _mm_add_ps(y0, _mm_mul_ps(t, _mm_sub_ps(y1, y0))));
+    }
+  } else {
+    const __m128 half = _mm_set1_ps(0.5f), two = _mm_set1_ps(2), twoAndHalf = _mm_set1_ps(2.5f), oneAndHalf = _mm_set1_ps(1.5f);
+    for (; k + 4 <= count; k += 4) {
+      const __m128 t = positions(start, increment, k, index);
+      const __m128 y0 = taps(data, index, -1), y1 = taps(data, index, 0), y2 = taps(data, index, 1), y3 = taps(data, index, 2);
+      // hermite(), term for term
+      const __m128 c1 = _mm_mul_ps(half, _mm_sub_ps(y2, y0));
+      const __m128 c2 = _mm_sub_ps(_mm_add_ps(_mm_sub_ps(y0, _mm_mul_ps(twoAndHalf, y1)), _mm_mul_ps(two, y2)), _mm_mul_ps(half, y3));
+      const __m128 c3 = _mm_add_ps(_mm_mul_ps(half, _mm_sub_ps(y3, y0)), _mm_mul_ps(oneAndHalf, _mm_sub_ps(y1, y2)));
+      const __m128 y = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(c3, t), c2), t), c1), t), y1);
+      _mm_storeu_ps(out + k, y);
+    }
+  }
+#endif
+  return k;
+}
+
+// the fast path: every tap of every position is inside the data
+inline void run(const float* data, double start, double increment, int count, float* out, Interpolation interpolation) {
+  switch (interpolation) {
+    case Interpolation::LINEAR:
+      for (int k = runVector(data, start, increment, count, out, interpolation); k < count; k++) {
+        const double p = start + k * increment;
+        const long i = (long)p;
+        const float t = (float)(p - i);
+        out[k] = data[i] + t * (data[i + 1] - data[i]);
+      }
+      break;
+    case Interpolation::CUBIC:
+      for (int k = runVector(data, start, increment, count, out, interpolation); k < count; k++) {
+        const double p = start + k * increment;
+        const long i = (long)p;
+        out[k] = hermite((float)(p - i), data[i - 1], data[i], data[i + 1], data[i + 2]);
+      }
+      break;
+    default: {
+      const float* table = sincTable();
+      for (int k = 0; k < count; k++) {
+        const double p = start + k * increment;
+        const long i = (long)p;
+        const int phase = (int)((p - i) * SINC_PHASES + 0.5);
+        out[k] = simd::dot(data + i - (SINC_TAPS / 2 - 1), table + phase * SINC_TAPS, SINC_TAPS);
+      }
+    }
+  }
+}
+
+// one sample near the ends, every tap wrapped
+inline float wrapped(const float* data, long size, double p, Interpolation interpolation) {
+  const long i = (long)floor(p);
+  const float t = (float)(p - i);
+  auto at = [&](long j) { j %= size; return data[j < 0 ? j + size : j]; };
+  switch (interpolation) {
+    case Interpolation::LINEAR: return at(i) + t * (at(i + 1) - at(i));
+    case Interpolation::CUBIC: return hermite(t, at(i - 1), at(i), at(i + 1), at(i + 2));
+    default: {
+      const float* row = sincTable() + (int)(t * SINC_PHASES + 0.5f) * SINC_TAPS;
+      float sum = 0;
+      for (int k = 0; k < SINC_TAPS; k++) sum += row[k] * at(i - (SINC_TAPS / 2 - 1) + k);
+      return sum;
+    }
+  }
+}
+
+// out[k] = x(start + k * increment); returns the (wrapped) position after the block
+inline double read(const float* data, long size, double start, double increment, int count, float* out,
+                   Interpolation interpolation = Interpolation::LINEAR) {
+  if (size <= 0) {
+    for (int k = 0; k < count; k++) out[k] = 0;
+    return 0;
+  }
+  const double lo = before(interpolation), hi = size - after(interpolation); // positions in [lo, hi) need no wrapping
+  double p = start;
+  while (count > 0) {
+    p = fmod(p, (double)size);
+    if (p < 0) p += size;
+
+    long n = 0; // samples before the run leaves [lo, hi)
+    if (p >= lo && p < hi) {
+      if (increment > 0) n = (long)ceil((hi - p) / increment);
+      else if (increment < 0) n = (long)floor((p - lo) / -increment) + 1;
+      else n = count;
+      if (n > count) n = count;
+      const double last = p + (n - 1) * increment;
+      if (n > 1 && (last >= hi || last < lo)) n--; // rounding at the very edge
+    }
+
+    if (n > 0) {
+      run(data, p, increment, (int)n, out, interpolation);
+    } else {
+      n = 1;
+      *out = wrapped(data, size, p, interpolation);
+    }
+    out += n;
+    count -= (int)n;
+    p += n * increment;
+  }
+  p = fmod(p, (double)size);
+  return (p < 0) ? p + size : p;
+}
+
+}  // namespace interpolate
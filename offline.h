@@ -0,0 +1,64 @@
+/* offline.h written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file defines the OfflineRenderer: a GrainEngine of its own, set up like the live one, that plays a list of
+ * timed triggers through the same grain voices as fast as the CPU allows instead of as fast as the sound card asks.
+ * freeze.h uses it to pre-render a sequencer's cycle in the background, bounce.h to render a session to a file.
+ * It has no grain field, so building one draws no random numbers and makes no meshes; build it once and
+ * configure it for each render.
+ */
+
+# pragma once
+
+#include <algorithm>
+#include <vector>
+#include "al/io/al_AudioIOData.hpp"
+#include "grains.h"
+
+const int OFFLINE_BLOCK = 512;
+const int OFFLINE_POLYPHONY = 100; // voices per FM flavor, like the live granulator starts with
+
+// one grain to start, frames into the render
+struct TimedTrigger {
+  long time;
+  GrainParams settings;
+  float gain;
+  int window;
+};
+
+struct OfflineRenderer {
+  GrainEngine engine{OFFLINE_POLYPHONY}; // its own voices, so an offline render never touches the live ones
+  al::AudioIOData io;
+  int channels = 0; // speakers, as many as the live granulator decodes to
+  long position = 0; // frames rendered so far
+  size_t next = 0; // the first trigger not started yet
+
+  // set up like config (the live granulator's config(), copied) and start again from frame 0; renders run on the
+  // calling thread only
+  void configure(const GrainEngine::Config& config) {
+    engine.configure(config);
+    channels = engine.spatializer.outputs;
+    io.framesPerBuffer(OFFLINE_BLOCK);
+    io.channels(channels, true);
+    position = 0;
+    next = 0;
+  }
+
+  // render the next frames of speaker output into out (planar, channels x frames), starting each trigger (sorted by
+  // time, counted from the first frame ever rendered) on its frame. Renders pick up where the last one stopped, so a
+  // long render can be done a chunk at a time; every chunk but the last has to be whole blocks, since the grains
+  // always render a whole block
+  void render(const std::vector<TimedTrigger>& triggers, long frames, float* out) {
+    for (long b = 0; b < frames; b += OFFLINE_BLOCK) {
+      const int n = (int)std::min((long)OFFLINE_BLOCK, frames - b);
+      for (; next < triggers.size() && triggers[next].time < position + OFFLINE_BLOCK; next++) {
+        const TimedTrigger& t = triggers[next];
+        engine.trigger(t.settings, t.gain, false, t.window, (int)std::max(0L, t.time - position));
+      }
+      io.zeroOut();
+      io.frame(0);
+      engine.render(io);
+      for (int c = 0; c < channels; c++) std::copy(io.outBuffer(c), io.outBuffer(c) + n, out + c * frames + b);
+      position += n;
+    }
+  }
+};
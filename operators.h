@@ -0,0 +1,101 @@
+/* operators.h written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file defines the algorithms for the multi-operator FM grains (OperatorGrain in grains.h): up to six sine
+ * operators wired DX-style, with optional feedback on one of them. An algorithm is a type, so its routing is fixed
+ * at compile time, and the grain renders a block at a time one operator after another (modulators first), with
+ * every operator's phases and outputs in their own contiguous lane. Only the phase sums (and the feedback operator)
+ * run sample by sample; the sines, modulation sums and envelope are plain loops over lanes that the compiler
+ * vectorizes, so each extra operator costs about the same as the last.
+ */
+
+# pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+const int MAX_OPERATORS = 6;
+const float FEEDBACK_AMOUNT = 0.15f; // of the feedback operator's last output, in cycles, added to its own phase
+const float FEEDBACK_HARMONICS = 12; // feedback that strong is nearly a saw: its harmonics fall about 12 dB an octave
+                                     // and are only under -40 dB past the 12th
+
+constexpr int countBits(unsigned x) { return x ? (int)(x & 1) + countBits(x >> 1) : 0; }
+
+// sin(2 pi x), x in cycles; only adds, multiplies and an abs, so loops over it vectorize. good to about 1e-6
+inline float sine(float x) {
+  float u = x - 0.25f;
+  u -= (u + 12582912.0f) - 12582912.0f; // minus the nearest integer (1.5 * 2^23 rounds it off), [-0.5, 0.5]
+  const float b = 2 * (float)M_PI * (fabsf(u) - 0.25f); // [-pi / 2, pi / 2]
+  const float b2 = b * b;
+  return -b * (1 + b2 * (-1.0f / 6 + b2 * (1.0f / 120 + b2 * (-1.0f / 5040 + b2 * (1.0f / 362880)))));
+}
+
+// ALGORITHMS
+// operators are numbered so modulators come after what they modulate; mods[i] has a bit for every operator
+// feeding operator i. Carriers play at the carrier glide times their ratio, modulators at the modulator glide
+// times theirs, and a modulator's depth scales the grain's modulation index.
+struct Stack3 { // 2 -> 1 -> 0
+  static constexpr int N = 3, FEEDBACK = -1;
+  static constexpr uint8_t mods[N] = {0b010, 0b100, 0};
+  static constexpr uint8_t carriers = 0b001;
+  static constexpr float ratio[N] = {1, 1, 2}, depth[N] = {0, 1, 0.5};
+};
+
+struct Stack4 { // 3 -> 2 -> 1 -> 0, 3 feeds back on itself
+  static constexpr int N = 4, FEEDBACK = 3;
+  static constexpr uint8_t mods[N] = {0b0010, 0b0100, 0b1000, 0};
+  static constexpr uint8_t carriers = 0b0001;
+  static constexpr float ratio[N] = {1, 1, 2, 3}, depth[N] = {0, 1, 0.6, 0.4};
+};
+
+struct TwoPairs { // 1 -> 0 and 3 -> 2, an octave apart
+  static constexpr int N = 4, FEEDBACK = 3;
+  static constexpr uint8_t mods[N] = {0b0010, 0, 0b1000, 0};
+  static constexpr uint8_t carriers = 0b0101;
+  static constexpr float ratio[N] = {1, 1, 2, 2}, depth[N] = {0, 1, 0, 0.8};
+};
+
+struct Branch { // 1, 2 and 3 all -> 0, 3 feeds back
+  static constexpr int N = 4, FEEDBACK = 3;
+  static constexpr uint8_t mods[N] = {0b1110, 0, 0, 0};
+  static constexpr uint8_t carriers = 0b0001;
+  static constexpr float ratio[N] = {1, 1, 2, 3}, depth[N] = {0, 0.7, 0.5, 0.4};
+};
+
+struct DX1 { // 1 -> 0 and 5 -> 4 -> 3 -> 2, 5 feeds back, like the DX7's first algorithm
+  static constexpr int N = 6, FEEDBACK = 5;
+  static constexpr uint8_t mods[N] = {0b000010, 0, 0b001000, 0b010000, 0b100000, 0};
+  static constexpr uint8_t carriers = 0b000101;
+  static constexpr float ratio[N] = {1, 1, 1, 1, 2, 3}, depth[N] = {0, 1, 0, 1, 0.6, 0.4};
+};
+
+struct Organ { // six carriers, 5 feeds back
+  static constexpr int N = 6, FEEDBACK = 5;
+  static constexpr uint8_t mods[N] = {0, 0, 0, 0, 0, 0};
+  static constexpr uint8_t carriers = 0b111111;
+  static constexpr float ratio[N] = {1, 2, 3, 4, 0.5, 6}, depth[N] = {0, 0, 0, 0, 0, 0};
+};
+
+const int NUM_ALGORITHMS = 6; // Stack3 ... Organ, picked by GrainSettings::algorithm 1 ... 6
+
+// highest frequency an algorithm's output reaches, by Carson's rule taken operator by operator, modulators first.
+// An operator's frequency peaks at its ratio times its glide plus the deviation of everything feeding it, and its
+// sidebands reach that far again for each modulator's own reach; the feedback operator counts as its harmonics. carrier and modulator are the glides' highest,
+// index the largest modulation index the grain plays (deviation / modulator, no more than 8)
+template <class Alg> constexpr float reach(float carrier, float modulator, float index) {
+  float peak[Alg::N] = {}, band[Alg::N] = {};
+  for (int i = Alg::N - 1; i >= 0; i--) {
+    peak[i] = band[i] = Alg::ratio[i] * (((Alg::carriers >> i) & 1) ? carrier : modulator);
+    if (i == Alg::FEEDBACK) band[i] = peak[i] *= FEEDBACK_HARMONICS; // and swings what it modulates as fast
+    for (int j = i + 1; j < Alg::N; j++)
+      if ((Alg::mods[i] >> j) & 1) {
+        const float deviation = Alg::depth[j] * index * peak[j];
+        peak[i] += deviation;
+        if (deviation > 0) band[i] += deviation + band[j]; // a modulator turned all the way down isn't heard
+      }
+  }
+  float top = 0;
+  for (int i = 0; i < Alg::N; i++)
+    if ((Alg::carriers >> i) & 1) top = std::max(top, band[i]);
+  return top;
+}
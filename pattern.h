@@ -0,0 +1,176 @@
+/* pattern.h written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file defines what a sequencer step can do beyond playing its grain (a probability, ratchets, a nudge off the
+ * grid and locks on gain, pitch and envelope) and the flat event table a pattern is compiled into. Tables are built
+ * on the graphics thread and handed to the audio thread whole, so playing a step is a dice roll and a few array
+ * reads however fancy the pattern is, and the audio thread never looks at the steps themselves.
+ */
+
+# pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "grains.h"
+
+const int MAX_RATCHETS = 8; // repeats one step can be split into
+const int MAX_PENDING = 256; // events waiting for a later block, per sequencer
+
+// per step, set from the step controls; the defaults play the grain once on the step, as it is
+struct StepOptions {
+  float probability = 1; // chance the step plays at all, rolled once for all of its ratchets
+  int ratchets = 1; // the grain repeats this many times, evenly over the step
+  float nudge = 0; // off the grid, in steps, -0.5 to 0.5
+  float gain = -1; // locks; negative plays at the sequencer's gain
+  float transpose = 0; // semitones
+  float envelope = -1; // attack share of the grain's duration; negative keeps the grain's own
+  int window = -1; // envelope shape; negative plays the sequencer's
+
+  bool operator==(const StepOptions& o) const {
+    return probability == o.probability && ratchets == o.ratchets && nudge == o.nudge && gain == o.gain &&
+           transpose == o.transpose && envelope == o.envelope && window == o.window;
+  }
+  bool operator!=(const StepOptions& o) const { return !(*this == o); }
+};
+
+// one grain to start, with the step's locks already applied
+struct PatternEvent {
+  GrainParams settings; // transposed, with the envelope override
+  float at; // in steps after the step it is filed under, 0 to 2
+  float gain; // negative plays at the sequencer's gain
+  int window; // negative plays the sequencer's window
+  uint32_t chance; // plays when a roll comes in at or under this
+  bool roll; // first event of its step; the rest go with its roll
+};
+
+// a compiled pattern, never changed once it is handed to the audio thread
+struct PatternTable {
+  long edits = -1; // the sequencer's edit count it was compiled from
+  std::vector<PatternEvent> events; // filed by step, each step's events together
+  std::vector<int> first; // where each step's events start, plus one past the end
+  bool random = false; // some step might not play, so the pattern can't be frozen
+
+  int steps() const { return (int)first.size() - 1; }
+
+  // file a step's events; a step nudged early is filed under the step before it, to start from its tick
+  static PatternTable* compile(const std::vector<std::pair<GrainParams, StepOptions>>& steps, long edits) {
+    PatternTable* t = new PatternTable;
+    t->edits = edits;
+    const int n = (int)steps.size();
+    std::vector<std::vector<PatternEvent>> filed(n);
+    for (int k = 0; k < n; k++) {
+      const StepOptions& o = steps[k].second;
+      GrainParams g = steps[k].first;
+      if (o.transpose != 0) g.transpose(powf(2.0f, o.transpose / 12.0f));
+      if (o.envelope >= 0) g.envelope = o.envelope;
+      const float p = std::clamp(o.probability, 0.0f, 1.0f);
+      const int ratchets = std::clamp(o.ratchets, 1, MAX_RATCHETS);
+      const float nudge = std::clamp(o.nudge, -0.5f, 0.5f);
+      t->random |= (p < 1);
+      const bool early = nudge < 0; // the whole step moves, so its ratchets stay together behind one roll
+      const int slot = early ? (k + n - 1) % n : k; // the first step's wraps round to the last
+      for (int r = 0; r < ratchets; r++)
+        filed[slot].push_back({g, nudge + (float)r / ratchets + (early ? 1 : 0), o.gain, o.window, (uint32_t)(p * 4294967295.0), r == 0});
+    }
+    for (int k = 0; k < n; k++) {
+      t->first.push_back((int)t->events.size());
+      t->events.insert(t->events.end(), filed[k].begin(), filed[k].end());
+    }
+    t->first.push_back((int)t->events.size());
+    return t;
+  }
+};
+
+// audio thread's side of a pattern: the table it plays from, where it is in it, and the dice
+struct PatternPlayer {
+  std::atomic<PatternTable*> incoming{nullptr}; // compiled, not yet picked up by the audio thread
+  std::atomic<PatternTable*> retired{nullptr}; // done with on the audio thread, deleted on the graphics thread
+  PatternTable* compiled = nullptr; // graphics thread: the newest table handed over; owned by one of the others
+
+  PatternTable* table = nullptr; // audio thread: what steps play from
+  PatternTable* previous = nullptr; // audio thread: replaced, but events of it may still be pending
+  int cursor = 0; // the step the next tick plays
+  uint32_t state = 1; // xorshift; never 0
+  bool playing = true; // the last roll
+  struct Pending {
+    long long time; // transport sample
+    const PatternTable* table;
+    int event;
+  };
+  Pending pending[MAX_PENDING]; // events past the end of the block their step ticked in
+  int waiting = 0;
+
+  ~PatternPlayer() {
+    delete table;
+    delete previous;
+    delete incoming.load();
+    delete retired.load();
+  }
+
+  void seed(uint32_t s) { state = s ? s : 1; }
+
+  uint32_t roll() { // xorshift32: a few shifts, good enough for dice
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  }
+
+  // graphics thread: delete what the audio thread let go of, and hand over a new table
+  void collect() { delete retired.exchange(nullptr); }
+  void publish(PatternTable* t) {
+    compiled = t;
+    delete incoming.exchange(t); // one the audio thread never picked up is stale by now
+  }
+
+  // audio thread, top of the block: switch to a new table once the one it replaces has nothing left pending
+  void pickUp() {
+    if (previous != nullptr && retired.load() == nullptr) {
+      bool used = false;
+      for (int p = 0; p < waiting; p++) used |= (pending[p].table == previous);
+      if (!used) {
+        retired = previous;
+        previous = nullptr;
+      }
+    }
+    if (previous == nullptr) {
+      PatternTable* t = incoming.exchange(nullptr);
+      if (t != nullptr) {
+        previous = table;
+        table = t;
+        if (cursor >= t->steps()) cursor = 0;
+      }
+    }
+  }
+
+  int steps() const { return table ? table->steps() : 0; }
+  bool atTop() const { return cursor == 0; } // the next tick starts a cycle
+  void advance() { cursor = (cursor + 1 < steps()) ? cursor + 1 : 0; }
+
+  // audio thread: the step under the cursor ticked at time (a transport sample, in the block that starts at now);
+  // fire(event, offset) starts what falls in the block, and the rest waits for its block
+  template <class Fire> void tick(long long time, double interval, long long now, int frames, Fire fire) {
+    for (int i = table->first[cursor]; i < table->first[cursor + 1]; i++) {
+      const PatternEvent& e = table->events[i];
+      if (e.roll) playing = roll() <= e.chance;
+      if (!playing) continue;
+      const long long t = time + llround(e.at * interval);
+      if (t < now + frames) fire(e, (int)(t - now));
+      else if (waiting < MAX_PENDING) pending[waiting++] = {t, table, i};
+    }
+  }
+
+  // audio thread: start the pending events that fall in this block
+  template <class Fire> void flush(long long now, int frames, Fire fire) {
+    for (int p = 0; p < waiting;) {
+      if (pending[p].time < now + frames) {
+        fire(pending[p].table->events[pending[p].event], (int)std::max(0LL, pending[p].time - now));
+        pending[p] = pending[--waiting];
+      } else {
+        p++;
+      }
+    }
+  }
+};
@@ -0,0 +1,81 @@
+/* policies.h written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file defines the pieces the FM grains in grains.h and operators.h are put together from at compile time
+ * (oscillators, glides and outputs), so each combination renders with its own tight loop and picking a flavor
+ * costs nothing per sample. Every policy takes the rate it runs at.
+ */
+
+# pragma once
+
+#include <algorithm>
+#include <cmath>
+#include "Gamma/Oscillator.h"
+#include "config.h"
+#include "spatial.h"
+
+// one shared cycle of a sine, read without interpolation by TableSine when the governor asks for cheap oscillators
+struct SineTable {
+  static const int SIZE = 4096;
+  float table[SIZE];
+
+  SineTable() { for (int i = 0; i < SIZE; i++) table[i] = sinf(2 * M_PI * i / SIZE); }
+  float operator()(float phase) const { return table[(int)(phase * SIZE) & (SIZE - 1)]; } // phase in cycles, [0, 1)
+
+  static const SineTable& shared() {
+    static SineTable t;
+    return t;
+  }
+};
+
+// oscillators: the next sample of a sine at hz
+struct GammaSine { // gam::Sine, the original oscillator
+  gam::Sine<float> osc;
+  void reset() { osc.freq(0); }
+  float operator()(float hz, float rate) {
+    osc.freq(hz * (SAMPLE_RATE / rate)); // gamma's domain runs at SAMPLE_RATE
+    return osc();
+  }
+};
+
+struct TableSine { // the shared sine table, no interpolation; what the governor falls back to
+  float phase = 0; // in cycles
+  void reset() { phase = 0; }
+  float operator()(float hz, float rate) {
+    phase += hz / rate;
+    phase -= floorf(phase);
+    return SineTable::shared()(phase);
+  }
+};
+
+// glides: from one frequency to another over the grain's exact length in samples, landing on the target at its
+// last sample, so nothing needs clamping or checking along the way
+struct ExpGlide { // equal ratios per sample, like ExpSeg used to, but a multiply instead of a pow
+  double value = 0, factor = 1; // double so long glides land where they should
+  void set(float from, float to, long samples) {
+    value = from;
+    factor = pow((double)to / from, 1.0 / std::max(1L, samples - 1));
+  }
+  float operator()() {
+    const float v = (float)value;
+    value *= factor;
+    return v;
+  }
+};
+
+struct LinearGlide { // equal steps in hz per sample, like Line used to
+  double value = 0, increment = 0;
+  void set(float from, float to, long samples) {
+    value = from;
+    increment = ((double)to - from) / std::max(1L, samples - 1);
+  }
+  float operator()() {
+    const float v = (float)value;
+    value += increment;
+    return v;
+  }
+};
+
+// outputs: where a finished block of the grain goes
+struct BusOut { // spread over the encoding bus by the grain's gains
+  static void write(SpatialBus& bus, const SpatialGains& gains, const float* out, int start, int end) { bus.mix(gains, out, start, end); }
+};
@@ -0,0 +1,420 @@
+/* render.h written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file defines how grains.h renders its voices: PolySynth only tells each active voice where its block starts,
+ * the voice queues itself, and the queue is then rendered either on the audio thread or split across a pool of
+ * real-time worker threads, each mixing into its own bus. The worker buses are summed before decoding.
+ * Grain durations vary from 10 ms to 1 s, so work is handed out in chunks of grains that idle workers steal
+ * from busy ones; the plain static split is kept to compare against. Grains that need more bandwidth than
+ * SAMPLE_RATE allows render into oversampled buses, and narrow-band ones into sub-rate buses; both are brought
+ * back to SAMPLE_RATE once per block.
+ */
+
+# pragma once
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "al/scene/al_PolySynth.hpp"
+#include "config.h"
+#include "resample.h"
+#include "simd.h"
+#include "spatial.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+const int MAX_RENDER_JOBS = 4 * MAX_GRAINS; // voices queued per block; PolySynth can grow past MAX_GRAINS
+const int PARALLEL_THRESHOLD = 64; // below this many voices the audio thread renders everything itself
+const int MAX_WORKERS = 16;
+const int RENDER_CHUNK = 8; // grains per unit of stolen work
+const double RENDER_BUDGET = 0.5; // share of a block's duration the workers get before the audio thread takes over
+const int MAX_OVERSAMPLE_SHIFT = 2; // grains render at up to 2^2 = 4 times SAMPLE_RATE
+const int MAX_UNDERSAMPLE_SHIFT = 2; // ...and down to a quarter of it
+
+inline void cpuRelax() {
+#if defined(__SSE2__) || defined(_M_X64)
+  _mm_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+struct RenderQueue;
+
+// a voice that renders mono into a bus's scratch block and mixes it into its bus channels
+struct GrainVoice : al::SynthVoice {
+  SpatialGains gains; // which bus channels it is mixed into, set once per trigger
+  RenderQueue* queue = nullptr; // set by the Granulator
+  int rateShift = 0; // renders at SAMPLE_RATE * 2^rateShift into the matching bus, set once per trigger
+
+  float rate() const { return ldexpf((float)SAMPLE_RATE, rateShift); }
+
+  // render from frame start to the end of the block (or until the voice is done) into bus
+  virtual void render(SpatialBus& bus, int start) = 0;
+  virtual float level() const = 0; // current envelope level, for stealing the quietest voices
+
+  void onProcess(al::AudioIOData& io) override; // audio thread; queues the voice, see below
+};
+
+struct RenderJob {
+  GrainVoice* voice;
+  int start;
+};
+
+struct RenderQueue {
+  RenderJob jobs[MAX_RENDER_JOBS];
+  int count = 0;
+  std::atomic<int> dropped{0}; // grains left out of a block because the queue was full, since the last report
+
+  void clear() { count = 0; }
+  bool push(GrainVoice* voice, int start) {
+    if (count == MAX_RENDER_JOBS) return false;
+    jobs[count++] = {voice, start};
+    return true;
+  }
+
+  void printDrops() { // graphics thread; the audio thread only counts
+    const int n = dropped.exchange(0, std::memory_order_relaxed);
+    if (n > 0) printf("render queue full, dropped %d grains for a block\n", n);
+  }
+};
+
+inline void GrainVoice::onProcess(al::AudioIOData& io) {
+  if (!queue->push(this, io.frame() + 1)) queue->dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+// the buses grains render into at rates other than SAMPLE_RATE: 2x and 4x for grains whose sidebands would
+// otherwise alias, 1/2 and 1/4 for narrow-band grains that don't need the full rate. Each participant has its own;
+// they are summed like the full-rate buses, then brought to SAMPLE_RATE into the full-rate bus once per block, so
+// the filtering costs per bus channel, not per grain. Each filter delays its bus by a different whole number of
+// samples, so the full-rate bus and the faster filters' outputs are delayed to match the slowest: every grain
+// comes out latency() late whatever rate it rendered at. Offsets between grains at SAMPLE_RATE and above stay
+// sample exact; a sub-rate grain starts on its bus's grid, so its onset is rounded down by up to 1 sample at 1/2
+// rate and 3 at 1/4 (under 0.07 ms), which is well inside a grain's attack.
+// Blocks have to be a multiple of 2^MAX_UNDERSAMPLE_SHIFT frames, so the sub-rate buses keep whole frames.
+struct MultiRateBus {
+  SpatialBus over[MAX_OVERSAMPLE_SHIFT]; // over[k] runs at 2^(k + 1) times SAMPLE_RATE
+  SpatialBus under[MAX_UNDERSAMPLE_SHIFT]; // under[k] runs at SAMPLE_RATE / 2^(k + 1)
+  Decimator decimators[MAX_OVERSAMPLE_SHIFT]; // only set up on the bus that is resolved
+  Interpolator interpolators[MAX_UNDERSAMPLE_SHIFT];
+  DelayLine align[1 + MAX_UNDERSAMPLE_SHIFT]; // before the decimators' outputs are added, then before each interpolator's
+
+  SpatialBus& at(int shift) { return (shift > 0) ? over[shift - 1] : under[-shift - 1]; }
+
+  // where a grain starting at frame start of the full-rate block starts in the bus for its shift, rounded down to
+  // the bus's grid below SAMPLE_RATE
+  static int start(int shift, int start) { return (shift >= 0) ? start << shift : start >> -shift; }
+
+  void resize(int channels, bool converters) {
+    for (int k = 0; k < MAX_OVERSAMPLE_SHIFT; k++) {
+      over[k].resize(channels, BLOCK_SIZE << (k + 1));
+      if (converters) decimators[k].setup(2 << k, channels);
+    }
+    for (int k = 0; k < MAX_UNDERSAMPLE_SHIFT; k++) {
+      under[k].resize(channels, BLOCK_SIZE >> (k + 1));
+      if (converters) interpolators[k].setup(2 << k, channels);
+    }
+    if (!converters) return;
+    align[0].setup(decimators[0].latency, channels);
+    for (int k = 0; k < MAX_UNDERSAMPLE_SHIFT; k++)
+      align[k + 1].setup(interpolators[k].latency - (k > 0 ? interpolators[k - 1].latency : decimators[0].latency), channels);
+  }
+
+  // samples every grain is delayed by on its way through resolve
+  int latency() const { return interpolators[MAX_UNDERSAMPLE_SHIFT - 1].latency; }
+
+  void clear(int frames) {
+    assert(frames % (1 << MAX_UNDERSAMPLE_SHIFT) == 0); // or the sub-rate timeline would drift a frame a block
+    for (int k = 0; k < MAX_OVERSAMPLE_SHIFT; k++) over[k].clear(frames << (k + 1));
+    for (int k = 0; k < MAX_UNDERSAMPLE_SHIFT; k++) under[k].clear(frames >> (k + 1));
+  }
+
+  static void add(SpatialBus& to, SpatialBus& from) {
+    for (int c = 0; c < to.channels; c++) {
+      if (!from.used[c]) continue;
+      simd::add(to.channel(c), from.channel(c), to.frames);
+      to.used[c] = true;
+    }
+  }
+
+  void add(MultiRateBus& other) { // sum another participant's buses into these
+    for (int k = 0; k < MAX_OVERSAMPLE_SHIFT; k++) add(over[k], other.over[k]);
+    for (int k = 0; k < MAX_UNDERSAMPLE_SHIFT; k++) add(under[k], other.under[k]);
+  }
+
+  // filter every bus to SAMPLE_RATE and add it into out, delaying what is already there in steps so that
+  // everything lines up at latency()
+  void resolve(SpatialBus& out) {
+    for (int c = 0; c < out.channels; c++) {
+      float* x = out.channel(c);
+      if (align[0].process(c, x, out.frames, !out.used[c])) out.used[c] = true;
+      for (int k = 0; k < MAX_OVERSAMPLE_SHIFT; k++)
+        if (decimators[k].process(c, over[k].used[c] ? over[k].channel(c) : nullptr, out.frames, x)) out.used[c] = true;
+      for (int k = 0; k < MAX_UNDERSAMPLE_SHIFT; k++) {
+        if (align[k + 1].process(c, x, out.frames, !out.used[c])) out.used[c] = true;
+        if (interpolators[k].process(c, under[k].used[c] ? under[k].channel(c) : nullptr, under[k].frames, x, out.frames))
+          out.used[c] = true;
+      }
+    }
+  }
+};
+
+// a participant's share of chunks; the owner pops from the bottom, thieves take from the top.
+// Both ends live in one word so every claim is a single compare-and-swap.
+struct alignas(64) ChunkDeque {
+  std::atomic<uint64_t> range{0}; // top in the high 32 bits, bottom in the low 32
+
+  void reset(uint32_t top, uint32_t bottom) { range.store(((uint64_t)top << 32) | bottom, std::memory_order_relaxed); }
+
+  bool pop(int& chunk) {
+    uint64_t r = range.load(std::memory_order_acquire);
+    while (true) {
+      uint32_t top = r >> 32, bottom = (uint32_t)r;
+      if (top >= bottom) return false;
+      if (range.compare_exchange_weak(r, ((uint64_t)top << 32) | (bottom - 1), std::memory_order_acq_rel)) {
+        chunk = bottom - 1;
+        return true;
+      }
+    }
+  }
+
+  bool empty() const {
+    const uint64_t r = range.load(std::memory_order_acquire);
+    return (uint32_t)(r >> 32) >= (uint32_t)r;
+  }
+
+  bool steal(int& chunk) {
+    uint64_t r = range.load(std::memory_order_acquire);
+    while (true) {
+      uint32_t top = r >> 32, bottom = (uint32_t)r;
+      if (top >= bottom) return false;
+      if (range.compare_exchange_weak(r, ((uint64_t)(top + 1) << 32) | bottom, std::memory_order_acq_rel)) {
+        chunk = top;
+        return true;
+      }
+    }
+  }
+};
+
+struct RenderWorkers {
+  struct Worker {
+    std::thread thread;
+    SpatialBus bus;
+    MultiRateBus rates;
+    // each block is claimed once, by the worker or by the audio thread going on without it, so both only ever
+    // move these from the last generation to the current one
+    std::atomic<int> claimed{0};
+    std::atomic<int> finished{0}; // the last generation it rendered into its buses
+  };
+
+  // parallel blocks only, for comparing the two schedulers. Only the audio thread writes them, one at a time, but
+  // they are atomics so they can be printed while audio may still be running
+  struct Stats {
+    std::atomic<double> seconds{0}, worst{0};
+    std::atomic<int> blocks{0};
+    std::atomic<int> late{0}; // blocks that took longer than their own duration
+    std::atomic<int> overruns{0}; // blocks the workers hadn't finished inside the budget
+    std::atomic<int> taken{0}; // chunks the audio thread took over from late workers
+
+    void add(double s, bool slow, bool overran, int chunks) {
+      seconds.store(seconds.load(std::memory_order_relaxed) + s, std::memory_order_relaxed);
+      if (s > worst.load(std::memory_order_relaxed)) worst.store(s, std::memory_order_relaxed);
+      blocks.fetch_add(1, std::memory_order_relaxed);
+      if (slow) late.fetch_add(1, std::memory_order_relaxed);
+      if (overran) overruns.fetch_add(1, std::memory_order_relaxed);
+      taken.fetch_add(chunks, std::memory_order_relaxed);
+    }
+    void print(const char* name) const {
+      const int n = blocks;
+      if (n > 0)
+        printf("%s: %.3f ms per block over %d blocks (worst %.3f ms), %d late, %d past the budget with %d chunks taken over\n",
+               name, 1000 * seconds / n, n, 1000 * worst, (int)late, (int)overruns, (int)taken);
+    }
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers; // rendering threads besides the audio thread
+  std::atomic<int> generation{0}; // bumped by the audio thread to hand out a block
+  std::atomic<int> sleeping{0};
+  std::atomic<bool> running{false};
+  std::mutex sleepMutex;
+  std::condition_variable wake;
+
+  const RenderQueue* queue = nullptr;
+  int frames = 0;
+
+  ChunkDeque deques[MAX_WORKERS];
+  std::atomic<bool> stealing{true}; // false renders with the static split
+  bool stealingThisBlock = true;
+  Stats staticStats, stealingStats;
+
+  ~RenderWorkers() { stop(); }
+
+  // not real-time safe; call before audio starts. n worker threads, each with a bus of the given width
+  void start(int n, int channels) {
+    stop();
+    running = true;
+    n = std::min(n, std::min(MAX_WORKERS, (int)std::thread::hardware_concurrency()) - 1); // spinning on a shared core only hurts
+    for (int i = 0; i < n; i++) {
+      workers.emplace_back(new Worker);
+      workers.back()->bus.resize(channels);
+      workers.back()->rates.resize(channels, false);
+      workers.back()->claimed = workers.back()->finished = generation.load(); // the last block is settled
+    }
+    for (int i = 0; i < workers.size(); i++) workers[i]->thread = std::thread([this, i] { loop(i); });
+  }
+
+  void stop() {
+    if (!running) return;
+    {
+      std::lock_guard<std::mutex> lock(sleepMutex); // see render
+      running = false;
+    }
+    wake.notify_all();
+    for (auto& w : workers) w->thread.join();
+    workers.clear();
+  }
+
+  static void pin(int core) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % std::max(1u, std::thread::hardware_concurrency()), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+  }
+
+  void renderJobs(int begin, int end, SpatialBus& bus, MultiRateBus& rates) {
+    for (int j = begin; j < end; j++) {
+      GrainVoice* voice = queue->jobs[j].voice;
+      if (voice->rateShift == 0) voice->render(bus, queue->jobs[j].start);
+      else voice->render(rates.at(voice->rateShift), MultiRateBus::start(voice->rateShift, queue->jobs[j].start));
+    }
+  }
+
+  void renderChunk(int chunk, SpatialBus& bus, MultiRateBus& rates) {
+    renderJobs(chunk * RENDER_CHUNK, std::min(queue->count, (chunk + 1) * RENDER_CHUNK), bus, rates);
+  }
+
+  // the share of the queue rendered by participant p of n (0 is the audio thread)
+  void renderShare(int p, int n, SpatialBus& bus, MultiRateBus& rates) {
+    int chunk;
+    while (deques[p].pop(chunk)) renderChunk(chunk, bus, rates);
+    if (!stealingThisBlock) return;
+    // then help the others; nothing is added during a block, so one pass over each deque is enough to finish
+    for (int k = 1; k < n; k++) {
+      ChunkDeque& victim = deques[(p + k) % n];
+      while (victim.steal(chunk)) renderChunk(chunk, bus, rates);
+    }
+  }
+
+  void loop(int index) {
+    pin(index + 1); // core 0 is left to the audio thread and everything else
+    int seen = 0;
+    while (running) {
+      // spin briefly, then sleep until the audio thread hands out the next block
+      int g = generation.load(std::memory_order_acquire);
+      for (int spin = 0; g == seen && spin < 20000; spin++) {
+        cpuRelax();
+        g = generation.load(std::memory_order_acquire);
+      }
+      if (g == seen) {
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleeping++;
+        wake.wait_for(lock, std::chrono::milliseconds(2), [&] { return generation.load() != seen || !running; });
+        sleeping--;
+        continue;
+      }
+      seen = g;
+
+      Worker& w = *workers[index];
+      int last = g - 1;
+      if (!w.claimed.compare_exchange_strong(last, g, std::memory_order_acq_rel)) continue; // woke too late for it
+      w.bus.clear(frames);
+      w.rates.clear(frames);
+      renderShare(index + 1, workers.size() + 1, w.bus, w.rates);
+      w.finished.store(g, std::memory_order_release);
+    }
+  }
+
+  // audio thread: render every queued voice into out (or rates, for voices at other rates), in parallel when
+  // there are enough of them. Workers get RENDER_BUDGET of the block; after that the audio thread renders the
+  // chunks they haven't started itself and only waits for the ones already in their hands
+  void render(const RenderQueue& q, SpatialBus& out, MultiRateBus& rates) {
+    queue = &q;
+    frames = out.frames;
+    if (workers.empty() || q.count < PARALLEL_THRESHOLD) {
+      renderJobs(0, q.count, out, rates);
+      return;
+    }
+
+    const auto begin = std::chrono::steady_clock::now();
+    const int n = workers.size() + 1;
+    stealingThisBlock = stealing;
+    const int chunks = (q.count + RENDER_CHUNK - 1) / RENDER_CHUNK;
+    for (int p = 0; p < n; p++) deques[p].reset(chunks * p / n, chunks * (p + 1) / n); // the static split, in chunks
+
+    const int g = generation.fetch_add(1) + 1; // sequentially consistent with the sleeping count below
+    if (sleeping.load() > 0) {
+      // a worker holds the mutex from testing the generation until it is blocked, so taking it here means no
+      // worker is between the two when notified; the lock is only ever taken when someone is asleep anyway
+      std::lock_guard<std::mutex> lock(sleepMutex);
+      wake.notify_all();
+    }
+
+    renderShare(0, n, out, rates);
+
+    // settle every worker: it either finishes, or the audio thread claims its block before it wakes up for it. One
+    // whose chunks are all gone has nothing left to wait for; past the budget, nobody does
+    const double budget = RENDER_BUDGET * frames / SAMPLE_RATE;
+    bool settled[MAX_WORKERS] = {}, rendered[MAX_WORKERS] = {};
+    int unsettled = workers.size(), taken = 0;
+    bool overran = false;
+    while (unsettled > 0) {
+      if (!overran && std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count() > budget) {
+        overran = true;
+        int chunk;
+        for (int p = 1; p < n; p++)
+          while (deques[p].steal(chunk)) {
+            renderChunk(chunk, out, rates);
+            taken++;
+          }
+      }
+      for (int i = 0; i < workers.size(); i++) {
+        if (settled[i]) continue;
+        Worker& w = *workers[i];
+        int last = g - 1;
+        if (w.finished.load(std::memory_order_acquire) == g) rendered[i] = true;
+        else if (!(overran || deques[i + 1].empty())) continue; // its chunks are still there for it
+        else if (!w.claimed.compare_exchange_strong(last, g, std::memory_order_acq_rel)) continue; // mid-chunk
+        settled[i] = true; // done, or never started and now never will
+        unsettled--;
+      }
+      if (unsettled > 0) cpuRelax();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    (stealingThisBlock ? stealingStats : staticStats).add(seconds, seconds > (double)frames / SAMPLE_RATE, overran, taken);
+
+    for (int i = 0; i < workers.size(); i++) { // sum the worker buses into the main one
+      if (!rendered[i]) continue; // still holds an older block
+      Worker* w = workers[i].get();
+      for (int c = 0; c < out.channels; c++) {
+        if (!w->bus.used[c]) continue;
+        simd::add(out.channel(c), w->bus.channel(c), frames);
+        out.used[c] = true;
+      }
+      rates.add(w->rates);
+    }
+  }
+};
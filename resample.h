@@ -0,0 +1,254 @@
+/* resample.h written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file defines the polyphase windowed-sinc Resampler buffer.h uses to bring files recorded at other rates
+ * (44.1 kHz, 96 kHz, ...) to SAMPLE_RATE as they load, so they play back at the right pitch.
+ * The ratio is reduced to up/down, every phase of the Kaiser-windowed sinc is computed once into a table, and
+ * each output sample is one simd::dot over the input. Input is pushed a block at a time so long files stream.
+ * It also defines the Decimator and Interpolator that bring oversampled and sub-rate grain buses back to
+ * SAMPLE_RATE once per block.
+ */
+
+# pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <vector>
+#include "config.h"
+#include "simd.h"
+
+struct Resampler {
+  enum Quality { DRAFT, GOOD, HIGH, BEST };
+  static const int MAX_PHASES = 1024; // ratios with more phases than this round to the nearest one
+
+  long up = 1, down = 1; // output rate / input rate, reduced
+  int taps = 0; // coefficients per phase, a multiple of 4
+  int rows = 0; // phases in the table
+  std::vector<float> table; // rows x taps
+
+  std::vector<float> pending; // input not consumed yet; pending[0] is the first tap of the next output
+  long position = 0; // index into pending of the next output's first tap
+  long phase = 0; // fractional part of the next output's position, in 1/up
+  long consumed = 0; // input frames pushed
+  long produced = 0; // output frames written
+
+  bool active() const { return up != down; }
+
+  // output frames for a given number of input frames
+  long length(long frames) const { return (frames * up + down - 1) / down; }
+
+  static double bessel0(double x) { // modified Bessel function of the first kind, order 0
+    double sum = 1, term = 1;
+    for (int k = 1; k < 32; k++) {
+      term *= (x / (2 * k)) * (x / (2 * k));
+      sum += term;
+    }
+    return sum;
+  }
+
+  void setup(int from, int to, int quality = HIGH) {
+    const long g = std::gcd((long)from, (long)to);
+    up = to / g;
+    down = from / g;
+    pending.clear();
+    position = phase = consumed = produced = 0;
+    if (!active()) return;
+
+    const int halves[] = {4, 8, 16, 32}; // zero crossings on each side
+    const double betas[] = {5, 6.5, 8, 10};
+    const double passbands[] = {0.85, 0.9, 0.94, 0.97};
+    quality = std::clamp(quality, (int)DRAFT, (int)BEST);
+
+    // when going down the filter has to cut below the new nyquist, so it gets wider by the same factor
+    const double cutoff = std::min(1.0, (double)up / down) * passbands[quality];
+    const int half = (int)ceil(halves[quality] / std::min(1.0, (double)up / down));
+    taps = (2 * half + 3) / 4 * 4;
+    rows = (up <= MAX_PHASES) ? up : MAX_PHASES + 1;
+    table.assign((size_t)rows * taps, 0.0f);
+
+    for (int r = 0; r < rows; r++) {
+      const double fraction = (up <= MAX_PHASES) ? (double)r / up : (double)r / MAX_PHASES;
+      float* row = &table[(size_t)r * taps];
+      double sum = 0;
+      for (int k = 0; k < 2 * half; k++) {
+        const double d = k - half + 1 - fraction; // distance from the output's position, in input samples
+        const double x = M_PI * cutoff * d;
+        const double sinc = (fabs(x) < 1e-9) ? 1.0 : sin(x) / x;
+        const double w = d / half;
+        const double kaiser = (fabs(w) >= 1) ? 0.0 : bessel0(betas[quality] * sqrt(1 - w * w)) / bessel0(betas[quality]);
+        row[k] = (float)(cutoff * sinc * kaiser);
+        sum += row[k];
+      }
+      for (int k = 0; k < 2 * half; k++) row[k] /= (float)sum; // exact unity gain at DC
+    }
+
+    pending.assign(half - 1, 0.0f); // taps before the first input sample
+  }
+
+  const float* coefficients(long p) const {
+    const long r = (up <= MAX_PHASES) ? p : (p * MAX_PHASES + up / 2) / up;
+    return &table[(size_t)r * taps];
+  }
+
+  // push n input frames; out(float) is called for every output frame that is ready
+  template <class F> void push(const float* in, long n, F& out) {
+    pending.insert(pending.end(), in, in + n);
+    consumed += n;
+    run(out, -1);
+  }
+
+  // write the tail still waiting on input past the end of the file
+  template <class F> void flush(F& out) {
+    pending.insert(pending.end(), taps + down / up + 1, 0.0f);
+    run(out, length(consumed));
+  }
+
+  template <class F> void run(F& out, long limit) {
+    while (position + taps <= (long)pending.size() && produced != limit) {
+      out(simd::dot(&pending[position], coefficients(phase), taps));
+      produced++;
+      phase += down;
+      position += phase / up;
+      phase %= up;
+    }
+    const long drop = std::min(position, (long)pending.size());
+    pending.erase(pending.begin(), pending.begin() + drop);
+    position -= drop;
+  }
+};
+
+// a Kaiser-windowed lowpass for filtering at a rate factor times SAMPLE_RATE down to SAMPLE_RATE, zeroCrossings
+// on each side at the lower rate, so it delays by exactly zeroCrossings * factor high-rate samples; taps padded to
+// a multiple of 4 for simd::dot
+inline std::vector<float> lowpass(int factor, int zeroCrossings, double beta) {
+  const int half = zeroCrossings * factor;
+  const int taps = (2 * half + 4) / 4 * 4;
+  const double cutoff = 0.9 / factor; // of the high rate's nyquist
+  std::vector<float> h(taps, 0.0f);
+  double sum = 0;
+  for (int k = 0; k <= 2 * half; k++) {
+    const double d = k - half; // symmetric about the middle tap
+    const double x = M_PI * cutoff * d;
+    const double w = d / half;
+    const double sinc = (d == 0) ? 1.0 : sin(x) / x;
+    h[k] = (float)(sinc * Resampler::bessel0(beta * sqrt(std::max(0.0, 1 - w * w))) / Resampler::bessel0(beta));
+    sum += h[k];
+  }
+  for (float& c : h) c /= (float)sum;
+  return h;
+}
+
+const int CONVERTER_ZERO_CROSSINGS = 8;
+
+// polyphase decimation of a bus's channels by 2 or 4: only every factor-th output of the lowpass is computed.
+// Keeps each channel's last taps - 1 inputs between blocks.
+struct Decimator {
+  int factor = 1;
+  int latency = 0; // in SAMPLE_RATE samples
+  std::vector<float> taps;
+  std::vector<std::vector<float>> history; // per channel, taps - 1 inputs then room for one block
+  std::vector<int> quiet; // blocks since a channel last had input; its history is silent after enough of them
+
+  void setup(int f, int channels) {
+    factor = f;
+    taps = lowpass(f, CONVERTER_ZERO_CROSSINGS, 8);
+    // padding first, so the middle tap lines up with an input on the low-rate grid and the delay is whole samples
+    const int half = CONVERTER_ZERO_CROSSINGS * f;
+    std::rotate(taps.begin(), taps.begin() + 2 * half + 1, taps.end());
+    latency = CONVERTER_ZERO_CROSSINGS;
+    history.assign(channels, std::vector<float>(taps.size() - 1 + (size_t)f * BLOCK_SIZE, 0.0f));
+    quiet.assign(channels, 1 << 20);
+  }
+
+  // in holds n * factor high-rate frames of channel c (or nullptr for silence); adds n frames to out.
+  // false when there was nothing to add
+  bool process(int c, const float* in, int n, float* out) {
+    const int keep = (int)taps.size() - 1;
+    if (in == nullptr) {
+      if ((long)quiet[c] * n * factor >= keep) return false; // nothing left ringing
+      quiet[c]++;
+    } else {
+      quiet[c] = 0;
+    }
+    std::vector<float>& h = history[c];
+    if (in != nullptr) std::copy(in, in + n * factor, h.begin() + keep);
+    else std::fill(h.begin() + keep, h.begin() + keep + n * factor, 0.0f);
+    for (int t = 0; t < n; t++) out[t] += simd::dot(&h[t * factor], taps.data(), taps.size());
+    std::copy(h.begin() + n * factor, h.begin() + n * factor + keep, h.begin());
+    return true;
+  }
+};
+
+// polyphase interpolation of a bus's channels by 2 or 4: each output phase is its own short filter over the
+// low-rate input, so no zeros are ever stuffed. Keeps each channel's last inputs between blocks.
+struct Interpolator {
+  int factor = 1;
+  int latency = 0; // in SAMPLE_RATE samples
+  int length = 0; // inputs per output, a multiple of 4
+  std::vector<float> phases; // factor rows of length, reversed so each output is one simd::dot
+  std::vector<std::vector<float>> history; // per channel, length - 1 inputs then room for one block
+  std::vector<int> quiet; // blocks since a channel last had input
+
+  void setup(int f, int channels) {
+    factor = f;
+    const std::vector<float> h = lowpass(f, CONVERTER_ZERO_CROSSINGS, 8);
+    latency = CONVERTER_ZERO_CROSSINGS * f;
+    length = (((int)h.size() + f - 1) / f + 3) / 4 * 4;
+    phases.assign((size_t)f * length, 0.0f);
+    for (int p = 0; p < f; p++)
+      for (int i = 0; i < length; i++) {
+        const int k = p + (length - 1 - i) * f;
+        if (k < (int)h.size()) phases[p * length + i] = f * h[k]; // f makes up for the zeros between inputs
+      }
+    history.assign(channels, std::vector<float>(length - 1 + BLOCK_SIZE / f + 1, 0.0f));
+    quiet.assign(channels, 1 << 20);
+  }
+
+  // in holds n low-rate frames of channel c (or nullptr for silence); adds the first frames of the n * factor
+  // outputs to out. false when there was nothing to add
+  bool process(int c, const float* in, int n, float* out, int frames) {
+    const int keep = length - 1;
+    if (in == nullptr) {
+      if ((long)quiet[c] * n >= keep) return false; // nothing left ringing
+      quiet[c]++;
+    } else {
+      quiet[c] = 0;
+    }
+    std::vector<float>& h = history[c];
+    if (in != nullptr) std::copy(in, in + n, h.begin() + keep);
+    else std::fill(h.begin() + keep, h.begin() + keep + n, 0.0f);
+    for (int t = 0; t < n; t++)
+      for (int p = 0; p < factor && t * factor + p < frames; p++)
+        out[t * factor + p] += simd::dot(&h[t], &phases[p * length], length);
+    std::copy(h.begin() + n, h.begin() + n + keep, h.begin());
+    return true;
+  }
+};
+
+// a whole-sample delay of a bus's channels, in place; what lines the converters' outputs up with each other
+struct DelayLine {
+  int delay = 0;
+  std::vector<std::vector<float>> history; // per channel, delay samples then room for one block
+  std::vector<int> quiet; // samples since a channel last had input
+
+  void setup(int d, int channels) {
+    delay = d;
+    history.assign(channels, std::vector<float>(d + BLOCK_SIZE, 0.0f));
+    quiet.assign(channels, 1 << 20);
+  }
+
+  // delay n samples of channel c; silent says they are all 0. False when there was nothing to delay, and x is left be
+  bool process(int c, float* x, int n, bool silent) {
+    if (silent) {
+      if (quiet[c] >= delay) return false;
+      quiet[c] += n;
+    } else {
+      quiet[c] = 0;
+    }
+    std::vector<float>& h = history[c];
+    std::copy(x, x + n, h.begin() + delay);
+    std::copy(h.begin(), h.begin() + n, x);
+    std::copy(h.begin() + n, h.begin() + n + delay, h.begin());
+    return true;
+  }
+};
@@ -1,76 +1,243 @@
 /* sequence.h written by Stejara Dinulescu
  * MAT240B 2021, Final Project
  * This file defines the Sequencer stuct used in granular-resynth.cpp
+ * Sequencers are created and destroyed while ReSynth runs. Each keeps its steps in play order plus a map from grain
+ * id to step, so clicking a grain in or out of a sequencer is O(1) however long the pattern is; a removed step
+ * stays behind, dead, until enough of them pile up to be worth compacting. The audio thread never reads the steps:
+ * they are compiled into an event table (pattern.h) on the graphics thread whenever they change.
  * References: granulator-source-material.cpp, frequency-modulation-grains.cpp, Scatter-Sequence.cpp written by Karl Yerkes
  */
 
 # pragma once
 
+#include <cmath>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include "al/ui/al_Parameter.hpp"
 #include "al/math/al_Random.hpp"  // rnd::uniform()
-#include "Gamma/Oscillator.h"
 #include "al/math/al_Functions.hpp"  // al::clip
 #include "grains.h"
+#include "pattern.h"
+#include "transport.h"
 
-const int NUM_SEQUENCERS = 3;
-int count_id = 0; // keeps track of how many sequencers have already been added to give the sequencer a unique id (and parameter name)
+const int NUM_SEQUENCERS = 3; // how many there are at startup; n adds more
+const int MAX_SEQUENCERS = MAX_GRAINS; // slots; never more sequencers than grains
+
+// the first three sequencers keep their old colors, the rest are spread around the hue circle by the golden ratio
+inline al::Vec3f sequencerColor(int id) {
+  if (id == 0) return al::Vec3f(0, 0, 1); // blue
+  if (id == 1) return al::Vec3f(0, 1, 0); // green
+  if (id == 2) return al::Vec3f(1, 1, 0); // yellow
+  const float h = 6 * fmodf(0.1f + id * 0.618034f, 1.0f);
+  const float x = 1 - fabsf(fmodf(h, 2.0f) - 1);
+  const float rgb[6][3] = {{1, x, 0}, {x, 1, 0}, {0, 1, x}, {0, x, 1}, {x, 0, 1}, {1, 0, x}};
+  const float* c = rgb[(int)h % 6];
+  return al::Vec3f(0.2f + 0.8f * c[0], 0.2f + 0.8f * c[1], 0.2f + 0.8f * c[2]); // pastel, so white grains still stand out
+}
 
 struct Sequencer {
-  int id = count_id; 
-  al::Parameter rate{"/rate of sequencer " + std::to_string(id+1), "", 1.0, "", -30.0, 50.0};  // user input for rate of sequencer
-  al::Parameter gain{"/gain of sequencer " + std::to_string(id+1), "", 0.6, "", 0.0, 0.99};  // user input for gain of sequencer
-  gam::Accum<> timer; // rate timer
-  int playhead = 0; // where we are in the sequencer
-  std::vector<GrainSettings> sequence; // stores the grain settings
-  bool active = false; // whether the sequencer is active for adding/removing grains
+  struct Step {
+    GrainParams settings;
+    StepOptions options;
+    bool alive;
+  };
+
+  int id; // its slot, reused once it is destroyed; gives the parameters their names
+  al::Parameter rate;  // user input for rate of sequencer, in steps per second; 0 stops it, below 0 runs as fast as above
+  al::Parameter gain;  // user input for gain of sequencer
+  al::ParameterInt window;  // envelope shape for its grains, -1 keeps each grain's own
+  al::ParameterBool freeze;  // play a pre-rendered cycle while the pattern stays the same
+  al::Parameter transpose;  // semitones, on top of the global transpose
+  al::Parameter timeScale;  // grain durations times this, on top of the global time scale
+  GrainScale scale; // audio thread: both of the above with the global ones, worked out at the top of each block
+  SequencerClock clock; // where its steps fall on the shared transport
+  PatternPlayer pattern; // the compiled steps, and where the audio thread is in them
+  std::vector<Step> steps; // stores the grain settings, in play order
+  std::unordered_map<int, int> members; // grain id -> its live step
+  int dead = 0; // removed steps still in the vector
+  long edits = 0; // bumped whenever the steps change, so the table gets compiled and a frozen loop knows it is stale
+  long compiled = -1; // the edits the pattern's table was last compiled from
+  int focus = -1; // the step the step controls edit, -1 for none
   al::Vec3f color; // each sequencer has a unique color
 
-  Sequencer() { 
-    timer.freq(rate); // set the timer
-    if (id == 0) {color = al::Vec3f(0, 0, 1);} // blue
-    else if (id == 1) {color = al::Vec3f(0, 1, 0);} // green 
-    else if (id == 2) {color = al::Vec3f(1, 1, 0);} // yellow
-    count_id += 1; 
+  Sequencer(int slot)
+    : id(slot),
+      rate{"/rate of sequencer " + std::to_string(slot + 1), "", 1.0, "", -30.0, 50.0},
+      gain{"/gain of sequencer " + std::to_string(slot + 1), "", 0.6, "", 0.0, 0.99},
+      window{"/window of sequencer " + std::to_string(slot + 1), "", -1, "", -1, NUM_WINDOWS - 1},
+      freeze{"/freeze sequencer " + std::to_string(slot + 1), "", 0.0},
+      transpose{"/transpose of sequencer " + std::to_string(slot + 1), "", 0.0, "", -24.0, 24.0},
+      timeScale{"/time scale of sequencer " + std::to_string(slot + 1), "", 1.0, "", 0.25, 4.0},
+      color(sequencerColor(slot)) {
+    reseed(0);
   }
 
-  void enable() { active = true; }
-  void disable() { active = false; }
+  // each sequencer rolls its own dice, the same ones every run for a given seed
+  void reseed(uint32_t seed) { pattern.seed((0x9E3779B9u * (id + 1)) ^ seed); }
 
-  void setTimer() {  if (timer.freq() != rate) timer.freq(rate); } // set the timer's frequency to the specified rate, also acts as a reset if rate changes
-  
-  GrainSettings grabSample() { return sequence[playhead]; }
-  void addSample(GrainSettings g) { sequence.push_back(g); }
+  int size() const { return (int)steps.size() - dead; } // live steps
+  GrainScale scaling(const GrainScale& global) const { return global * GrainScale::of(transpose, timeScale); }
+  bool contains(int grain) const { return members.count(grain) > 0; }
 
-  void increment() { 
-    playhead++; // increment playhead
-    if (playhead >= sequence.size()) { // reset if need be
-      playhead -= sequence.size();
-      if (playhead < 0) { playhead = 0; } // bounds check
+  int next(int i) const { // the live step after i, wrapping
+    for (int k = 0; k < (int)steps.size(); k++) {
+      i = (i + 1 < (int)steps.size()) ? i + 1 : 0;
+      if (steps[i].alive) return i;
     }
+    return 0;
   }
 
-  bool checkIntersection(al::Vec3f pos) { // for when using the mouse to select grains
-    bool found = false;
-    for (auto iterator = sequence.begin(); iterator != sequence.end();) {
-      if (iterator->position == pos) {
-        found = true;
-        sequence.erase(iterator); // erases all the copies in the sequence
-      } else {
-        ++iterator;  // only advance the iterator when we don't erase
-      }
+  int previous(int i) const { // the live step before i, wrapping
+    for (int k = 0; k < (int)steps.size(); k++) {
+      i = (i > 0) ? i - 1 : (int)steps.size() - 1;
+      if (steps[i].alive) return i;
     }
-    return found;
+    return 0;
+  }
+
+  // add the grain if it isn't in the sequence, take it out if it is; true when it was added. An added step gets
+  // the focus
+  bool toggle(const GrainParams& g) {
+    edits++;
+    auto found = members.find(g.id);
+    if (found == members.end()) {
+      members[g.id] = (int)steps.size();
+      steps.push_back({g, StepOptions(), true});
+      focus = (int)steps.size() - 1;
+      return true;
+    }
+    const int removed = found->second;
+    steps[removed].alive = false;
+    members.erase(found);
+    dead++;
+    if (focus == removed) focus = -1;
+    if (dead > size()) compact();
+    return false;
+  }
+
+  void focusNext(int direction) { // move the focus along the live steps
+    if (size() == 0) return;
+    if (focus < 0) focus = next(-1);
+    else focus = (direction > 0) ? next(focus) : previous(focus);
+  }
+
+  void compact() { // drop the dead steps, keeping the focus on the same step
+    int kept = 0, focused = -1;
+    for (int i = 0; i < (int)steps.size(); i++) {
+      if (!steps[i].alive) continue;
+      if (i == focus) focused = kept;
+      members[steps[i].settings.id] = kept;
+      steps[kept++] = steps[i];
+    }
+    steps.resize(kept);
+    dead = 0;
+    focus = focused;
+  }
+
+  // graphics thread, every frame: compile the live steps into a new table for the audio thread once they change
+  void update() {
+    pattern.collect();
+    if (compiled == edits) return;
+    std::vector<std::pair<GrainParams, StepOptions>> live;
+    live.reserve(size());
+    for (const Step& s : steps) if (s.alive) live.push_back({s.settings, s.options});
+    pattern.publish(PatternTable::compile(live, edits));
+    compiled = edits;
   }
 
   // debugging purposes
-  void sayName() {std::cout << "i am sequence " << id << " " << active << std::endl;} 
+  void sayName() {std::cout << "i am sequence " << id << " with " << size() << " steps" << std::endl;}
   void printSamples() {
-    for (int i = 0; i < sequence.size(); i++) {
-      std::cout << sequence[i].position << " ";
-    }
+    for (const Step& s : steps) if (s.alive) std::cout << s.settings.position << " ";
     std::cout << std::endl;
   }
-};
\ No newline at end of file
+};
+
+// the focused step's options, edited the same way as the sequencer controls below
+struct StepControls {
+  al::Parameter probability{"/step probability", "", 1.0, "", 0.0, 1.0};
+  al::ParameterInt ratchets{"/step ratchets", "", 1, "", 1, MAX_RATCHETS};
+  al::Parameter nudge{"/step nudge", "", 0.0, "", -0.5, 0.5}; // in steps
+  al::Parameter gain{"/step gain", "", -0.1, "", -0.1, 0.99}; // below 0 plays at the sequencer's gain
+  al::Parameter transpose{"/step transpose", "", 0.0, "", -24.0, 24.0}; // semitones
+  al::Parameter envelope{"/step envelope", "", -0.1, "", -0.1, 1.0}; // below 0 keeps the grain's own
+  al::ParameterInt window{"/step window", "", -1, "", -1, NUM_WINDOWS - 1}; // -1 plays the sequencer's
+  const Sequencer* shown = nullptr;
+  int step = -1;
+
+  StepOptions read() {
+    StepOptions o;
+    o.probability = probability.get();
+    o.ratchets = ratchets.get();
+    o.nudge = nudge.get();
+    o.gain = gain.get() < 0 ? -1 : gain.get();
+    o.transpose = transpose.get();
+    o.envelope = envelope.get() < 0 ? -1 : envelope.get();
+    o.window = window.get();
+    return o;
+  }
+
+  // graphics thread, every frame: load the controls from a newly focused step, otherwise write them to it
+  void sync(Sequencer* s) {
+    if (s == nullptr || s->focus < 0) {
+      shown = nullptr;
+      return;
+    }
+    StepOptions& o = s->steps[s->focus].options;
+    if (s != shown || s->focus != step) {
+      probability.set(o.probability);
+      ratchets.set(o.ratchets);
+      nudge.set(o.nudge);
+      gain.set(o.gain < 0 ? -0.1 : o.gain);
+      transpose.set(o.transpose);
+      envelope.set(o.envelope < 0 ? -0.1 : o.envelope);
+      window.set(o.window);
+      shown = s;
+      step = s->focus;
+      return;
+    }
+    const StepOptions edited = read();
+    if (edited != o) {
+      o = edited;
+      s->edits++; // recompiled next update
+    }
+  }
+};
+
+// the GUI shows the selected sequencer's controls; these stand in for them and follow the selection
+struct SequencerControls {
+  al::Parameter rate{"/sequencer rate", "", 1.0, "", -30.0, 50.0};
+  al::Parameter gain{"/sequencer gain", "", 0.6, "", 0.0, 0.99};
+  al::ParameterInt window{"/sequencer window", "", -1, "", -1, NUM_WINDOWS - 1};
+  al::ParameterBool freeze{"/sequencer freeze", "", 0.0};
+  al::Parameter transpose{"/sequencer transpose", "", 0.0, "", -24.0, 24.0};
+  al::Parameter timeScale{"/sequencer time scale", "", 1.0, "", 0.25, 4.0};
+  const Sequencer* shown = nullptr;
+
+  // graphics thread, every frame: load the controls from a newly selected sequencer, otherwise write them to it
+  void sync(Sequencer* s) {
+    if (s == nullptr) {
+      shown = nullptr;
+      return;
+    }
+    if (s != shown) {
+      rate.set(s->rate.get());
+      gain.set(s->gain.get());
+      window.set(s->window.get());
+      freeze.set(s->freeze.get());
+      transpose.set(s->transpose.get());
+      timeScale.set(s->timeScale.get());
+      shown = s;
+      return;
+    }
+    if (s->rate.get() != rate.get()) s->rate.set(rate.get());
+    if (s->gain.get() != gain.get()) s->gain.set(gain.get());
+    if (s->window.get() != window.get()) s->window.set(window.get());
+    if (s->freeze.get() != freeze.get()) s->freeze.set(freeze.get());
+    if (s->transpose.get() != transpose.get()) s->transpose.set(transpose.get());
+    if (s->timeScale.get() != timeScale.get()) s->timeScale.set(timeScale.get());
+  }
+};
@@ -0,0 +1,152 @@
+/* session.h written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file defines the Session: the grain field, every sequencer with its steps, and the sliders that change how
+ * they sound, saved to a plain text file and loaded back. granular-resynth.cpp saves one from the running app and
+ * loads one at startup; the offline render (bounce.h) plays one back without opening a window.
+ * Numbers are written with 9 significant digits, so every float reads back exactly as it was.
+ */
+
+# pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <vector>
+#include "grains.h"
+#include "sequence.h"
+#include "transport.h"
+
+const int SESSION_VERSION = 2; // 2 added the time-stretch sliders; version 1 files load with it off
+
+struct Session {
+  Granulator& granulator;
+  std::vector<std::unique_ptr<Sequencer>>& sequencers; // by slot, empty slots stay empty
+  Transport& transport;
+
+  static void write(FILE* file, const GrainParams& g) {
+    fprintf(file, "%.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %d %.9g %d %d %d %.9g %.9g %.9g %.9g %d",
+            g.carrier_start, g.carrier_end, g.modulator_start, g.modulator_end, g.modulator_depth, g.md_start, g.md_end,
+            g.envelope, g.gain, g.duration, g.onset, g.type, g.rate, g.window, g.glide, g.algorithm,
+            g.position.x, g.position.y, g.position.z, g.size, g.id);
+  }
+
+  static bool read(FILE* file, GrainParams& g) {
+    return fscanf(file, "%f %f %f %f %f %f %f %f %f %f %f %d %f %d %d %d %f %f %f %f %d",
+                  &g.carrier_start, &g.carrier_end, &g.modulator_start, &g.modulator_end, &g.modulator_depth, &g.md_start, &g.md_end,
+                  &g.envelope, &g.gain, &g.duration, &g.onset, &g.type, &g.rate, &g.window, &g.glide, &g.algorithm,
+                  &g.position.x, &g.position.y, &g.position.z, &g.size, &g.id) == 21;
+  }
+
+  bool save(const char* filePath) const {
+    FILE* file = fopen(filePath, "w");
+    if (file == NULL) {
+      printf("failed to save session %s\n", filePath);
+      return false;
+    }
+    fprintf(file, "resynth-session %d\n", SESSION_VERSION);
+    fprintf(file, "tempo %.9g\n", (float)transport.tempo);
+    fprintf(file, "sliders %.9g %.9g %.9g %d %d %d %d\n", (float)granulator.gain, (float)granulator.transpose, (float)granulator.timeScale,
+            (int)granulator.spatialize.get(), (int)granulator.antialias.get(), (int)granulator.subRate.get(), (int)granulator.nGrains);
+    TimeStretch& t = granulator.stretcher;
+    fprintf(file, "stretch %.9g %.9g %.9g %.9g %d\n", (float)t.gain, (float)t.stretch, (float)t.pitch, (float)t.grainSize, (int)t.streams);
+    fprintf(file, "grains %d\n", (int)granulator.settings.size());
+    for (const GrainSettings& g : granulator.settings) {
+      write(file, g);
+      fprintf(file, "\n");
+    }
+    int count = 0;
+    for (auto& s : sequencers) count += (s != nullptr);
+    fprintf(file, "sequencers %d\n", count);
+    for (auto& s : sequencers) {
+      if (!s) continue;
+      fprintf(file, "sequencer %d %.9g %.9g %d %d %.9g %.9g %d\n", s->id, (float)s->rate, (float)s->gain, (int)s->window.get(),
+              (int)s->freeze.get(), (float)s->transpose, (float)s->timeScale, s->size());
+      for (const Sequencer::Step& step : s->steps) { // the grain as it was added, which the field may have moved on from
+        if (!step.alive) continue;
+        const StepOptions& o = step.options;
+        fprintf(file, "step %.9g %d %.9g %.9g %.9g %.9g %d ", o.probability, o.ratchets, o.nudge, o.gain, o.transpose, o.envelope, o.window);
+        write(file, step.settings);
+        fprintf(file, "\n");
+      }
+    }
+    fclose(file);
+    return true;
+  }
+
+  // replaces the field and every sequencer; not real-time safe, so before audio starts. False (and nothing
+  // changed) when the file can't be read
+  bool load(const char* filePath) {
+    FILE* file = fopen(filePath, "r");
+    if (file == NULL) {
+      printf("failed to load session %s\n", filePath);
+      return false;
+    }
+    int version = 0, grains = 0, count = 0, spatialize = 0, antialias = 1, subRate = 1, shown = 0;
+    float tempo, gain, transpose, timeScale;
+    float stretchGain = 0, stretch = 1, pitch = 0, grainSize = 0.08f;
+    int streams = 1;
+    bool ok = fscanf(file, " resynth-session %d", &version) == 1 && version >= 1 && version <= SESSION_VERSION &&
+              fscanf(file, " tempo %f", &tempo) == 1 &&
+              fscanf(file, " sliders %f %f %f %d %d %d %d", &gain, &transpose, &timeScale, &spatialize, &antialias, &subRate, &shown) == 7 &&
+              (version < 2 || fscanf(file, " stretch %f %f %f %f %d", &stretchGain, &stretch, &pitch, &grainSize, &streams) == 5) &&
+              fscanf(file, " grains %d", &grains) == 1 && grains >= 0 && grains <= MAX_GRAINS;
+    std::vector<GrainParams> field(ok ? grains : 0);
+    for (int i = 0; ok && i < grains; i++) ok = read(file, field[i]);
+    ok = ok && fscanf(file, " sequencers %d", &count) == 1;
+    std::vector<std::unique_ptr<Sequencer>> loaded;
+    for (int k = 0; ok && k < count; k++) {
+      int slot, window, freeze, steps;
+      float rate, sequenceGain, sequenceTranspose, sequenceTimeScale;
+      ok = fscanf(file, " sequencer %d %f %f %d %d %f %f %d", &slot, &rate, &sequenceGain, &window, &freeze, &sequenceTranspose, &sequenceTimeScale, &steps) == 8 &&
+           slot >= 0 && slot < MAX_SEQUENCERS &&
+           (slot >= (int)loaded.size() || !loaded[slot]);
+      if (!ok) break;
+      if (slot >= (int)loaded.size()) loaded.resize(slot + 1);
+      loaded[slot] = std::make_unique<Sequencer>(slot);
+      Sequencer& s = *loaded[slot];
+      s.rate.set(rate);
+      s.gain.set(sequenceGain);
+      s.window.set(window);
+      s.freeze.set(freeze);
+      s.transpose.set(sequenceTranspose);
+      s.timeScale.set(sequenceTimeScale);
+      for (int i = 0; ok && i < steps; i++) {
+        StepOptions o;
+        GrainParams g;
+        ok = fscanf(file, " step %f %d %f %f %f %f %d", &o.probability, &o.ratchets, &o.nudge, &o.gain, &o.transpose, &o.envelope, &o.window) == 7 && read(file, g);
+        if (ok && s.toggle(g)) s.steps.back().options = o; // a grain in twice would take itself out again
+      }
+      s.focus = -1;
+    }
+    fclose(file);
+    if (!ok) {
+      printf("session %s is damaged or from another version\n", filePath);
+      return false;
+    }
+
+    transport.tempo.set(tempo);
+    granulator.gain.set(gain);
+    granulator.transpose.set(transpose);
+    granulator.timeScale.set(timeScale);
+    granulator.spatialize.set(spatialize);
+    granulator.antialias.set(antialias);
+    granulator.subRate.set(subRate);
+    granulator.nGrains.set(shown);
+    granulator.stretcher.gain.set(stretchGain);
+    granulator.stretcher.stretch.set(stretch);
+    granulator.stretcher.pitch.set(pitch);
+    granulator.stretcher.grainSize.set(grainSize);
+    granulator.stretcher.streams.set(std::clamp(streams, 1, MAX_STREAMS));
+    for (int i = 0; i < grains && i < (int)granulator.settings.size(); i++) {
+      static_cast<GrainParams&>(granulator.settings[i]) = field[i]; // the mesh stays
+      granulator.settings[i].id = i;
+      granulator.settings[i].color = al::Vec3f(1.0, 1.0, 1.0);
+    }
+    for (auto& s : loaded)
+      if (s)
+        for (auto& member : s->members)
+          if (member.first >= 0 && member.first < (int)granulator.settings.size()) granulator.settings[member.first].color = s->color;
+    sequencers = std::move(loaded);
+    return true;
+  }
+};
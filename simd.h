@@ -0,0 +1,164 @@
+/* simd.h written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file defines the small block kernels (add, scale, multiply-add, dot product, deinterleave, downmix) the audio
+ * and file loading paths are built on
+ * SSE is used on x86, NEON on ARM, and a plain loop everywhere else
+ */
+
+# pragma once
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define RESYNTH_SSE 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RESYNTH_NEON 1
+#endif
+
+namespace simd {
+
+// dst[i] += src[i]
+inline void add(float* dst, const float* src, int n) {
+  int i = 0;
+#if defined(RESYNTH_SSE)
+  for (; i + 4 <= n; i += 4) _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_loadu_ps(src + i)));
+#elif defined(RESYNTH_NEON)
+  for (; i + 4 <= n; i += 4) vst1q_f32(dst + i, vaddq_f32(vld1q_f32(dst + i), vld1q_f32(src + i)));
+#endif
+  for (; i < n; i++) dst[i] += src[i];
+}
+
+// dst[i] += g * src[i]
+inline void mulAdd(float* dst, const float* src, float g, int n) {
+  int i = 0;
+#if defined(RESYNTH_SSE)
+  const __m128 gv = _mm_set1_ps(g);
+  for (; i + 4 <= n; i += 4) _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(gv, _mm_loadu_ps(src + i))));
+#elif defined(RESYNTH_NEON)
+  const float32x4_t gv = vdupq_n_f32(g);
+  for (; i + 4 <= n; i += 4) vst1q_f32(dst + i, vmlaq_f32(vld1q_f32(dst + i), gv, vld1q_f32(src + i)));
+#endif
+  for (; i < n; i++) dst[i] += g * src[i];
+}
+
+// dst[i] *= g
+inline void scale(float* dst, float g, int n) {
+  int i = 0;
+#if defined(RESYNTH_SSE)
+  const __m128 gv = _mm_set1_ps(g);
+  for (; i + 4 <= n; i += 4) _mm_storeu_ps(dst + i, _mm_mul_ps(gv, _mm_loadu_ps(dst + i)));
+#elif defined(RESYNTH_NEON)
+  const float32x4_t gv = vdupq_n_f32(g);
+  for (; i + 4 <= n; i += 4) vst1q_f32(dst + i, vmulq_f32(gv, vld1q_f32(dst + i)));
+#endif
+  for (; i < n; i++) dst[i] *= g;
+}
+
+// sum of a[i] * b[i]
+inline float dot(const float* a, const float* b, int n) {
+  int i = 0;
+  float sum = 0;
+#if defined(RESYNTH_SSE)
+  __m128 acc = _mm_setzero_ps();
+  for (; i + 4 <= n; i += 4) acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+  float lanes[4];
+  _mm_storeu_ps(lanes, acc);
+  sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif defined(RESYNTH_NEON)
+  float32x4_t acc = vdupq_n_f32(0);
+  for (; i + 4 <= n; i += 4) acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+  float lanes[4];
+  vst1q_f32(lanes, acc);
+  sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+  for (; i < n; i++) sum += a[i] * b[i];
+  return sum;
+}
+
+// split interleaved frames into one array per channel; 2, 4 and 8 channels take a vector path
+inline void deinterleave(const float* in, int channels, long frames, float* const* out) {
+  long i = 0;
+#if defined(RESYNTH_SSE)
+  if (channels == 2) {
+    for (; i + 4 <= frames; i += 4) {
+      __m128 a = _mm_loadu_ps(in + 2 * i), b = _mm_loadu_ps(in + 2 * i + 4);
+      _mm_storeu_ps(out[0] + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+      _mm_storeu_ps(out[1] + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+  } else if (channels == 4 || channels == 8) {
+    for (; i + 4 <= frames; i += 4) {
+      for (int half = 0; half < channels; half += 4) { // a 4x4 transpose per group of four channels
+        const float* f = in + channels * i + half;
+        __m128 r0 = _mm_loadu_ps(f), r1 = _mm_loadu_ps(f + channels), r2 = _mm_loadu_ps(f + 2 * channels), r3 = _mm_loadu_ps(f + 3 * channels);
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        _mm_storeu_ps(out[half] + i, r0);
+        _mm_storeu_ps(out[half + 1] + i, r1);
+        _mm_storeu_ps(out[half + 2] + i, r2);
+        _mm_storeu_ps(out[half + 3] + i, r3);
+      }
+    }
+  }
+#elif defined(RESYNTH_NEON)
+  if (channels == 2) {
+    for (; i + 4 <= frames; i += 4) {
+      float32x4x2_t v = vld2q_f32(in + 2 * i);
+      vst1q_f32(out[0] + i, v.val[0]);
+      vst1q_f32(out[1] + i, v.val[1]);
+    }
+  } else if (channels == 4) {
+    for (; i + 4 <= frames; i += 4) {
+      float32x4x4_t v = vld4q_f32(in + 4 * i);
+      for (int c = 0; c < 4; c++) vst1q_f32(out[c] + i, v.val[c]);
+    }
+  }
+#endif
+  for (; i < frames; i++)
+    for (int c = 0; c < channels; c++) out[c][i] = in[channels * i + c];
+}
+
+// average interleaved frames down to mono
+inline void downmix(const float* in, int channels, long frames, float* out) {
+  const float g = 1.0f / channels;
+  long i = 0;
+#if defined(RESYNTH_SSE)
+  const __m128 gv = _mm_set1_ps(g);
+  if (channels == 2) {
+    for (; i + 4 <= frames; i += 4) {
+      __m128 a = _mm_loadu_ps(in + 2 * i), b = _mm_loadu_ps(in + 2 * i + 4);
+      __m128 sum = _mm_add_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+      _mm_storeu_ps(out + i, _mm_mul_ps(gv, sum));
+    }
+  } else if (channels % 4 == 0) {
+    for (; i + 4 <= frames; i += 4) {
+      __m128 sum = _mm_setzero_ps();
+      for (int half = 0; half < channels; half += 4) {
+        const float* f = in + channels * i + half;
+        __m128 r0 = _mm_loadu_ps(f), r1 = _mm_loadu_ps(f + channels), r2 = _mm_loadu_ps(f + 2 * channels), r3 = _mm_loadu_ps(f + 3 * channels);
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        sum = _mm_add_ps(sum, _mm_add_ps(_mm_add_ps(r0, r1), _mm_add_ps(r2, r3)));
+      }
+      _mm_storeu_ps(out + i, _mm_mul_ps(gv, sum));
+    }
+  }
+#elif defined(RESYNTH_NEON)
+  const float32x4_t gv = vdupq_n_f32(g);
+  if (channels == 2) {
+    for (; i + 4 <= frames; i += 4) {
+      float32x4x2_t v = vld2q_f32(in + 2 * i);
+      vst1q_f32(out + i, vmulq_f32(gv, vaddq_f32(v.val[0], v.val[1])));
+    }
+  } else if (channels == 4) {
+    for (; i + 4 <= frames; i += 4) {
+      float32x4x4_t v = vld4q_f32(in + 4 * i);
+      vst1q_f32(out + i, vmulq_f32(gv, vaddq_f32(vaddq_f32(v.val[0], v.val[1]), vaddq_f32(v.val[2], v.val[3]))));
+    }
+  }
+#endif
+  for (; i < frames; i++) {
+    float sum = 0;
+    for (int c = 0; c < channels; c++) sum += in[channels * i + c];
+    out[i] = g * sum;
+  }
+}
+
+}  // namespace simd
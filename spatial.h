@@ -0,0 +1,341 @@
+/* spatial.h written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file defines the Spatializer used by grains.h to place grains on 2 to MAX_OUTPUT_CHANNELS speakers
+ * Grains render mono, are encoded once per trigger into a few bus channels (pan groups, VBAP speakers or
+ * ambisonic components), and the bus is decoded to the speakers once per block.
+ * References: Pulkki, "Virtual Sound Source Positioning Using Vector Base Amplitude Panning" (1997),
+ *             Zotter & Frank, "Ambisonics" (2019) for the SN3D/ACN harmonics and max-rE weights
+ */
+
+# pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "al/math/al_Vec.hpp"
+#include "al/io/al_AudioIOData.hpp"
+#include "config.h"
+#include "simd.h"
+
+const int PAN_GROUPS = 9; // odd, so that the middle group sits dead centre
+const int MAX_BUS_CHANNELS = 32; // widest encoding bus: pan groups, up to 32 VBAP speakers or 16 ambisonic components
+const int MAX_SPATIAL_TERMS = 16; // most bus channels a single grain writes to (third order ambisonics)
+
+// the bus channels and gains one grain is mixed into, computed once when it is triggered
+struct SpatialGains {
+  int count = 0;
+  int channel[MAX_SPATIAL_TERMS];
+  float gain[MAX_SPATIAL_TERMS];
+
+  void clear() { count = 0; }
+  void push(int c, float g) {
+    if (count < MAX_SPATIAL_TERMS) {
+      channel[count] = c;
+      gain[count] = g;
+      count++;
+    }
+  }
+};
+
+// unit vector in the ambisonic frame (x front, y left, z up) from azimuth (counterclockwise) and elevation in degrees
+inline al::Vec3f direction(float azimuth, float elevation) {
+  float a = azimuth * M_PI / 180.0f, e = elevation * M_PI / 180.0f;
+  return al::Vec3f(cosf(a) * cosf(e), sinf(a) * cosf(e), sinf(e));
+}
+
+// direction of a grain as heard from the middle of the grain field (x about [0, 4], y and z about [-2, 2]),
+// with the camera behind the listener: on-screen right is right, up is up and into the screen is front
+inline al::Vec3f fieldDirection(const al::Vec3f& position) {
+  al::Vec3f d = position - al::Vec3f(2.0, 0.0, 0.0);
+  al::Vec3f v(-d.z, -d.x, d.y);
+  if (v.mag() < 1e-6f) return al::Vec3f(1.0, 0.0, 0.0);
+  return v.normalize();
+}
+
+struct SpeakerLayout {
+  std::vector<al::Vec3f> directions;
+
+  void add(float azimuth, float elevation) { directions.push_back(direction(azimuth, elevation)); }
+  int size() const { return directions.size(); }
+
+  bool horizontal() const {
+    for (auto& d : directions) if (fabsf(d.z) > 1e-3f) return false;
+    return true;
+  }
+
+  static SpeakerLayout stereo() {
+    SpeakerLayout l;
+    l.add(30, 0); // left
+    l.add(-30, 0); // right
+    return l;
+  }
+
+  static SpeakerLayout ring(int n) { // channel 1 in front, going clockwise
+    if (n == 2) return stereo();
+    SpeakerLayout l;
+    for (int i = 0; i < n; i++) l.add(-360.0f * i / n, 0);
+    return l;
+  }
+
+  bool load(const char* filePath) { // one "azimuth elevation" pair in degrees per line, one line per output channel
+    FILE* file = fopen(filePath, "r");
+    if (file == NULL) {
+      printf("failed to load speaker layout %s\n", filePath);
+      return false;
+    }
+    SpeakerLayout loaded;
+    float azimuth, elevation;
+    while (fscanf(file, "%f %f", &azimuth, &elevation) == 2 && loaded.size() < MAX_OUTPUT_CHANNELS) loaded.add(azimuth, elevation);
+    fclose(file);
+    if (loaded.size() == 0) return false;
+    *this = loaded;
+    return true;
+  }
+};
+
+// real spherical harmonics, SN3D normalisation, ACN order, up to third order
+inline void harmonics(const al::Vec3f& d, float* y, int order) {
+  const float x = d.x, yy = d.y, z = d.z;
+  y[0] = 1;
+  if (order < 1) return;
+  y[1] = yy;
+  y[2] = z;
+  y[3] = x;
+  if (order < 2) return;
+  y[4] = sqrtf(3.0f) * x * yy;
+  y[5] = sqrtf(3.0f) * yy * z;
+  y[6] = 0.5f * (3 * z * z - 1);
+  y[7] = sqrtf(3.0f) * x * z;
+  y[8] = 0.5f * sqrtf(3.0f) * (x * x - yy * yy);
+  if (order < 3) return;
+  y[9] = sqrtf(5.0f / 8) * yy * (3 * x * x - yy * yy);
+  y[10] = sqrtf(15.0f) * x * yy * z;
+  y[11] = sqrtf(3.0f / 8) * yy * (5 * z * z - 1);
+  y[12] = 0.5f * z * (5 * z * z - 3);
+  y[13] = sqrtf(3.0f / 8) * x * (5 * z * z - 1);
+  y[14] = 0.5f * sqrtf(15.0f) * z * (x * x - yy * yy);
+  y[15] = sqrtf(5.0f / 8) * x * (x * x - 3 * yy * yy);
+}
+
+// bus channels, one block long, that a set of grains is mixed into. Buses at other rates than SAMPLE_RATE
+// (see MultiRateBus in render.h) hold a block of their own rate, so capacity is in frames of that rate.
+struct SpatialBus {
+  std::vector<float> data;
+  bool used[MAX_BUS_CHANNELS] = {};
+  int channels = 0;
+  int frames = 0;
+  int capacity = 0; // frames per channel
+  static const int LANES = 10;
+  std::vector<float> storage;
+  float* scratch = nullptr; // a grain renders its mono block here before it is mixed into the bus channels
+  float* lanes[LANES] = {}; // more scratch, for grains that render in several passes
+
+  SpatialBus() {}
+  SpatialBus(const SpatialBus&) = delete; // scratch and lanes point into storage
+  SpatialBus& operator=(const SpatialBus&) = delete;
+
+  void resize(int c, int frameCapacity = BLOCK_SIZE) {
+    channels = c;
+    capacity = frameCapacity;
+    data.assign(c * capacity, 0.0f);
+    std::fill(used, used + MAX_BUS_CHANNELS, false);
+    storage.assign((1 + LANES) * capacity, 0.0f);
+    scratch = storage.data();
+    for (int i = 0; i < LANES; i++) lanes[i] = scratch + (i + 1) * capacity;
+  }
+
+  float* channel(int c) { return data.data() + c * capacity; }
+
+  void clear(int n) { // only the channels something was mixed into last block need zeroing
+    for (int c = 0; c < channels; c++) {
+      if (used[c]) std::fill(channel(c), channel(c) + frames, 0.0f);
+      used[c] = false;
+    }
+    frames = n;
+  }
+
+  // add a grain's mono block [start, end) into its bus channels
+  void mix(const SpatialGains& g, const float* src, int start, int end) {
+    for (int k = 0; k < g.count; k++) {
+      simd::mulAdd(channel(g.channel[k]) + start, src + start, g.gain[k], end - start);
+      used[g.channel[k]] = true;
+    }
+  }
+};
+
+struct Spatializer {
+  enum Mode { PAN, VBAP, AMBISONIC_1, AMBISONIC_3 };
+
+  Mode mode = PAN;
+  SpeakerLayout layout;
+  int outputs = 2; // speakers
+  std::vector<float> decoder; // outputs x bus channels, row major
+
+  struct Base { int speaker[3]; float inverse[9]; }; // a VBAP speaker pair (2D) or triplet (3D) and its inverted matrix
+  std::vector<Base> bases;
+  bool planar = true;
+
+  SpatialBus bus;
+
+  Spatializer() { configure(PAN, SpeakerLayout::stereo()); }
+
+  static bool parseMode(const std::string& name, Mode& m) {
+    if (name == "pan") m = PAN;
+    else if (name == "vbap") m = VBAP;
+    else if (name == "ambi1") m = AMBISONIC_1;
+    else if (name == "ambi3") m = AMBISONIC_3;
+    else return false;
+    return true;
+  }
+
+  int order() const { return mode == AMBISONIC_3 ? 3 : 1; }
+
+  // not real-time safe; call before audio starts
+  void configure(Mode m, const SpeakerLayout& l) {
+    mode = m;
+    layout = l;
+    outputs = std::min(layout.size(), MAX_OUTPUT_CHANNELS);
+    if (mode == PAN) outputs = 2;
+
+    int channels = outputs;
+    if (mode == PAN) channels = PAN_GROUPS;
+    if (mode == AMBISONIC_1 || mode == AMBISONIC_3) channels = (order() + 1) * (order() + 1);
+    bus.resize(channels);
+    decoder.assign(outputs * channels, 0.0f);
+
+    if (mode == PAN) {
+      for (int k = 0; k < PAN_GROUPS; k++) { // equal power, scaled so the centre group keeps unity gain on both sides
+        float angle = (float)k / (PAN_GROUPS - 1) * M_PI / 2;
+        decoder[0 * channels + k] = sqrtf(2.0f) * cosf(angle);
+        decoder[1 * channels + k] = sqrtf(2.0f) * sinf(angle);
+      }
+    } else if (mode == VBAP) {
+      for (int s = 0; s < outputs; s++) decoder[s * channels + s] = 1; // the bus channels are the speakers
+      findBases();
+    } else {
+      // sampling decoder with max-rE weighting; by the addition theorem each speaker gets
+      // sum over orders of (2l + 1) w_l P_l(cos angle to the source) / N
+      const float maxRE1[] = {1.0f, 0.577f};
+      const float maxRE3[] = {1.0f, 0.861f, 0.612f, 0.305f};
+      const float* weight = order() == 3 ? maxRE3 : maxRE1;
+      float y[16];
+      for (int s = 0; s < outputs; s++) {
+        harmonics(layout.directions[s], y, order());
+        for (int e = 0; e < channels; e++) {
+          int l = (int)sqrtf((float)e);
+          decoder[s * channels + e] = (2 * l + 1) * weight[l] * y[e] / outputs;
+        }
+      }
+    }
+  }
+
+  void findBases() {
+    bases.clear();
+    planar = layout.horizontal();
+    const auto& d = layout.directions;
+    if (planar) { // neighbouring pairs around the circle
+      std::vector<int> order(outputs);
+      for (int s = 0; s < outputs; s++) order[s] = s;
+      std::sort(order.begin(), order.end(), [&](int a, int b) { return atan2f(d[a].y, d[a].x) < atan2f(d[b].y, d[b].x); });
+      for (int k = 0; k < outputs && outputs > 1; k++) {
+        int a = order[k], b = order[(k + 1) % outputs];
+        float det = d[a].x * d[b].y - d[a].y * d[b].x;
+        if (fabsf(det) < 1e-6f) continue;
+        Base base = {{a, b, -1}, {d[b].y / det, -d[a].y / det, 0, -d[b].x / det, d[a].x / det, 0, 0, 0, 0}};
+        bases.push_back(base);
+      }
+      return;
+    }
+    for (int a = 0; a < outputs; a++) // triplets that are faces of the convex hull of the speakers
+      for (int b = a + 1; b < outputs; b++)
+        for (int c = b + 1; c < outputs; c++) {
+          const al::Vec3f &p = d[a], &q = d[b], &r = d[c];
+          al::Vec3f u = q - p, v = r - p;
+          al::Vec3f normal(u.y * v.z - u.z * v.y, u.z * v.x - u.x * v.z, u.x * v.y - u.y * v.x);
+          int above = 0, below = 0;
+          for (int s = 0; s < outputs; s++) {
+            float side = normal.dot(d[s] - p);
+            if (side > 1e-4f) above++;
+            if (side < -1e-4f) below++;
+          }
+          if (above > 0 && below > 0) continue;
+          float det = p.x * (q.y * r.z - q.z * r.y) - p.y * (q.x * r.z - q.z * r.x) + p.z * (q.x * r.y - q.y * r.x);
+          if (fabsf(det) < 1e-3f) continue;
+          Base base = {{a, b, c},
+                       {(q.y * r.z - q.z * r.y) / det, (p.z * r.y - p.y * r.z) / det, (p.y * q.z - p.z * q.y) / det,
+                        (q.z * r.x - q.x * r.z) / det, (p.x * r.z - p.z * r.x) / det, (p.z * q.x - p.x * q.z) / det,
+                        (q.x * r.y - q.y * r.x) / det, (p.y * r.x - p.x * r.y) / det, (p.x * q.y - p.y * q.x) / det}};
+          bases.push_back(base);
+        }
+  }
+
+  // gains for a grain at this position in the field; spatialize off puts every grain front and centre
+  void encode(const al::Vec3f& position, bool spatialize, SpatialGains& g) const {
+    g.clear();
+    if (mode == PAN) {
+      float pan = spatialize ? al::clip(position.x / 4.0f, 1.0f, 0.0f) : 0.5f; // x spans about [0, 4]
+      g.push((int)roundf(pan * (PAN_GROUPS - 1)), 1.0f);
+      return;
+    }
+
+    al::Vec3f d = spatialize ? fieldDirection(position) : al::Vec3f(1.0, 0.0, 0.0);
+    if (mode == VBAP) {
+      vbap(d, g);
+      return;
+    }
+
+    float y[16];
+    harmonics(d, y, order());
+    for (int e = 0; e < bus.channels; e++) g.push(e, y[e]);
+  }
+
+  void vbap(al::Vec3f d, SpatialGains& g) const {
+    if (planar) {
+      d.z = 0;
+      if (d.mag() < 1e-6f) d = al::Vec3f(1.0, 0.0, 0.0);
+      d.normalize();
+    }
+    const Base* best = nullptr;
+    float bestGains[3] = {1, 0, 0}, bestMin = -1e9f;
+    for (auto& b : bases) {
+      float gains[3];
+      for (int r = 0; r < 3; r++) gains[r] = d.x * b.inverse[r] + d.y * b.inverse[3 + r] + d.z * b.inverse[6 + r];
+      float smallest = planar ? std::min(gains[0], gains[1]) : std::min(gains[0], std::min(gains[1], gains[2]));
+      if (smallest > bestMin) {
+        bestMin = smallest;
+        best = &b;
+        std::copy(gains, gains + 3, bestGains);
+      }
+    }
+    if (best == nullptr) { // a single speaker
+      g.push(0, 1.0f);
+      return;
+    }
+    int n = planar ? 2 : 3;
+    float power = 0;
+    for (int k = 0; k < n; k++) {
+      bestGains[k] = std::max(bestGains[k], 0.0f);
+      power += bestGains[k] * bestGains[k];
+    }
+    for (int k = 0; k < n; k++) {
+      float gain = power > 0 ? bestGains[k] / sqrtf(power) : 1.0f / sqrtf((float)n);
+      if (gain > 1e-4f) g.push(best->speaker[k], gain);
+    }
+  }
+
+  void clear(int frames) { bus.clear(frames); }
+
+  // decode the bus to the speakers, once per block
+  void decode(al::AudioIOData& io) {
+    const int n = std::min(outputs, (int)io.channelsOut());
+    for (int e = 0; e < bus.channels; e++) {
+      if (!bus.used[e]) continue;
+      for (int s = 0; s < n; s++) {
+        float g = decoder[s * bus.channels + e];
+        if (g != 0) simd::mulAdd(io.outBuffer(s), bus.channel(e), g, bus.frames);
+      }
+    }
+  }
+};
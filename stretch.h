@@ -0,0 +1,110 @@
+/* stretch.h written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file defines the TimeStretch engine grains.h plays the loaded source through: each stream is an overlap-add
+ * of Hann-windowed grains, four to a window, whose read head crawls through the file at 1 / stretch while each grain
+ * reads at the pitch ratio, so time and pitch move independently. Grain starts are scheduled once per block and
+ * every stream renders with block reads and a window table, so several run on one core.
+ */
+
+# pragma once
+
+#include <algorithm>
+#include <cmath>
+#include "al/ui/al_Parameter.hpp"
+#include "config.h"
+#include "interpolate.h"
+#include "spatial.h"
+#include "window.h"
+
+const int MAX_STREAMS = 8;
+const int STRETCH_OVERLAP = 4; // grains sounding at once in a stream
+const int MIN_STRETCH_SIZE = 960; // samples; the grain size slider's 0.02 s, so hops are never shorter than 240
+// the grains still sounding from the last block (one more than the overlap when the size isn't a multiple of four)
+// plus the most that can start in one block at the shortest hop
+const int STRETCH_SLOTS = STRETCH_OVERLAP + 1 + (BLOCK_SIZE * STRETCH_OVERLAP + MIN_STRETCH_SIZE - 1) / MIN_STRETCH_SIZE;
+
+struct StretchStream {
+  struct Slot {
+    bool active = false;
+    double index = 0; // read position in the source
+    long age = 0; // samples since the grain started; negative until it starts within the block
+  };
+  Slot slots[STRETCH_SLOTS];
+  double position = -1; // where the next grain starts reading, in source samples; negative until placed
+  long untilNext = 0; // samples until the next grain starts
+  SpatialGains gains;
+  float grain[BLOCK_SIZE]; // one grain's block, before windowing
+
+  // add one block of the stream into out[0, n)
+  void render(const float* data, long frames, double stretch, double pitch, int grainSize, float gain, float* out, int n) {
+    const int hop = std::max(1, grainSize / STRETCH_OVERLAP);
+
+    // schedule the grains that start in this block
+    while (untilNext < n) {
+      Slot* free = nullptr;
+      for (Slot& s : slots) if (!s.active) { free = &s; break; }
+      if (free != nullptr) *free = {true, position + untilNext / stretch, -untilNext};
+      untilNext += hop;
+    }
+    untilNext -= n;
+    position = fmod(position + n / stretch, (double)frames);
+
+    int size;
+    const float* window = WindowTables::shared().get(HANN, grainSize, size);
+    const double step = (double)size / grainSize;
+    gain *= 2.0f / STRETCH_OVERLAP; // four overlapping Hann windows sum to 2
+    for (Slot& s : slots) {
+      if (!s.active) continue;
+      const int begin = (int)std::max(0L, -s.age);
+      const int count = (int)std::min((long)(n - begin), grainSize - std::max(0L, s.age));
+      s.index = interpolate::read(data, frames, s.index, pitch, count, grain, Interpolation::LINEAR);
+      const long age = std::max(0L, s.age);
+      for (int i = 0; i < count; i++) out[begin + i] += gain * WindowTables::at(window, (age + i) * step) * grain[i];
+      s.age += n;
+      if (s.age >= grainSize) s.active = false;
+    }
+  }
+};
+
+struct TimeStretch {
+  al::Parameter stretch{"/stretch", "", 1.0, "", 0.25, 8.0}; // how many times longer the source plays out
+  al::Parameter pitch{"/pitch shift", "", 0.0, "", -24.0, 24.0}; // in semitones
+  al::Parameter grainSize{"/stretch grain size", "", 0.08, "", MIN_STRETCH_SIZE / (float)SAMPLE_RATE, 0.3}; // seconds
+  al::Parameter gain{"/stretch gain", "", 0.0, "", 0.0, 1.0}; // 0 turns the engine off
+  al::ParameterInt streams{"/stretch streams", "", 1, "", 1, MAX_STREAMS}; // spread evenly through the file
+
+  StretchStream stream[MAX_STREAMS];
+  int placed = 0; // how many streams the read heads were last spread for
+
+  // spread the first n read heads evenly through the file, starting from wherever the first one is; streams that
+  // were silent start over, the others let their sounding grains finish and carry on from their new place
+  void place(int n, long frames) {
+    const double first = std::max(0.0, stream[0].position);
+    for (int k = 0; k < n; k++) {
+      StretchStream& s = stream[k];
+      if (k >= placed) {
+        for (StretchStream::Slot& slot : s.slots) slot.active = false;
+        s.untilNext = 0;
+      }
+      s.position = fmod(first + (double)frames * k / n, (double)frames);
+    }
+    placed = n;
+  }
+
+  // audio thread, into the encoding bus
+  void render(const float* data, long frames, Spatializer& spatializer, bool spatialize) {
+    if (data == nullptr || frames <= 0 || gain <= 0) return;
+    SpatialBus& bus = spatializer.bus;
+    const int n = streams;
+    const double ratio = pow(2.0, pitch / 12.0);
+    const int size = std::max(MIN_STRETCH_SIZE, (int)(grainSize * SAMPLE_RATE));
+    if (n != placed) place(n, frames);
+    for (int k = 0; k < n; k++) {
+      StretchStream& s = stream[k];
+      std::fill(bus.scratch, bus.scratch + bus.frames, 0.0f);
+      s.render(data, frames, stretch, ratio, size, gain, bus.scratch, bus.frames);
+      spatializer.encode(al::Vec3f(4.0f * (k + 0.5f) / n, 0, 0), spatialize, s.gains); // spread left to right
+      bus.mix(s.gains, bus.scratch, 0, bus.frames);
+    }
+  }
+};
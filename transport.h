@@ -0,0 +1,122 @@
+/* transport.h written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file defines the Transport that clocks every sequencer from one sample counter. Each sequencer's rate is
+ * held as a small ratio of the tempo, and its steps land on a grid laid from the same origin, so sequencers stay
+ * locked to each other (3 against 2 lines up every beat, forever) instead of drifting apart on their own timers.
+ * Once per block, before the grains render, the steps of every sequencer that fall inside the block are collected
+ * into one list sorted by frame, and the audio thread triggers them in that order at their exact offsets.
+ */
+
+# pragma once
+
+#include <algorithm>
+#include <cmath>
+#include "al/ui/al_Parameter.hpp"
+#include "config.h"
+
+const int MAX_DENOMINATOR = 32; // rates snap to the nearest ratio of the tempo with at most this denominator
+const int MAX_EVENTS = 1024; // steps one block can hold, across all sequencers
+
+const int MAX_BEATS_PER_STEP = 1 << 20; // the slowest rate: one step every this many beats
+
+// a sequencer's rate over the tempo
+struct Ratio {
+  int num = 0, den = 1; // 0 is stopped
+
+  bool operator==(const Ratio& r) const { return num == r.num && den == r.den; }
+  bool operator!=(const Ratio& r) const { return !(*this == r); }
+
+  // negative rates step just as fast as positive ones, like the gam::Accum timers the sequencers used to run on, and
+  // only a rate of exactly 0 stops. Rates too slow for any ratio with a small denominator step every whole number
+  // of beats instead
+  static Ratio nearest(double x) {
+    Ratio best;
+    x = fabs(x);
+    if (!(x > 0) || !std::isfinite(x)) return best;
+    if (lround(x * MAX_DENOMINATOR) < 1) return {1, (int)lround(std::min(1 / x, (double)MAX_BEATS_PER_STEP))};
+    double error = x;
+    for (int d = 1; d <= MAX_DENOMINATOR; d++) {
+      const long n = lround(x * d);
+      if (n < 1) continue;
+      const double e = fabs(x - (double)n / d);
+      if (e < error - 1e-12) { // ties keep the smaller denominator
+        error = e;
+        best = {(int)n, d};
+      }
+    }
+    return best;
+  }
+};
+
+// where one sequencer is on the transport's grid; lives in the Sequencer
+struct SequencerClock {
+  Ratio ratio;
+  long long step = 0; // steps since the transport's origin, of the next step to fire
+  double interval = 0; // samples per step, for placing ratchets and nudges between steps
+  bool placed = false; // false until the next step has been found on the grid
+};
+
+struct TransportEvent {
+  int offset; // frame in the block
+  int sequencer; // index into the list of sequencers scheduled
+};
+
+struct Transport {
+  al::Parameter tempo{"/tempo", "", 1.0, "", 0.1, 20.0}; // beats per second; every sequencer rate is a ratio of it
+
+  long long now = 0; // samples since the first block
+  long long origin = 0; // where the current grid was laid
+  float laid = 0; // the tempo it was laid at
+
+  TransportEvent events[MAX_EVENTS]; // this block's steps, by frame
+  int count = 0;
+
+  double beat() const { return SAMPLE_RATE / (double)laid; } // samples per beat
+
+  // samples between the steps of a sequencer at rate, once snapped to the tempo
+  double interval(float rate) {
+    const Ratio r = Ratio::nearest(rate / tempo);
+    return (r.num == 0) ? 0 : SAMPLE_RATE / (double)tempo * r.den / r.num;
+  }
+
+  // audio thread, top of the callback: collect every step of every sequencer in [now, now + frames). A changed
+  // rate takes effect in this block, at the next step its new ratio has on the grid. Sequencers is a list of
+  // pointers, which may be null for empty slots
+  template <class Sequencers> void schedule(Sequencers& sequencers, int frames) {
+    if (laid != tempo) { // lay a new grid from here; every clock finds its place on it again
+      laid = tempo;
+      origin = now;
+      for (auto& s : sequencers) if (s) s->clock.placed = false;
+    }
+    count = 0;
+    for (int i = 0; i < (int)sequencers.size(); i++) {
+      if (!sequencers[i]) continue;
+      SequencerClock& clock = sequencers[i]->clock;
+      const Ratio r = Ratio::nearest(sequencers[i]->rate / laid);
+      if (r != clock.ratio) {
+        clock.ratio = r;
+        clock.placed = false;
+      }
+      if (r.num == 0) continue; // stopped
+      const double interval = beat() * r.den / r.num;
+      clock.interval = interval;
+      if (!clock.placed) {
+        clock.step = (long long)ceil((now - origin) / interval);
+        clock.placed = true;
+      }
+      for (;; clock.step++) {
+        const long long t = origin + llround(clock.step * interval);
+        if (t >= now + frames) break;
+        if (t >= now && count < MAX_EVENTS) events[count++] = {(int)(t - now), i};
+      }
+    }
+    std::stable_sort(events, events + count, [](const TransportEvent& a, const TransportEvent& b) { return a.offset < b.offset; });
+    now += frames;
+  }
+
+  // audio thread: a block nobody could schedule; its steps are skipped and the clocks catch up next block
+  void skip(int frames) {
+    count = 0;
+    now += frames;
+  }
+};
@@ -0,0 +1,115 @@
+/* window.h written by Stejara Dinulescu
+ * MAT240B 2021, Final Project
+ * This file defines the grain envelopes: every window shape is computed once into tables at a few resolutions,
+ * and a grain reads its envelope with a phase increment, interpolating between table points so a long grain on a
+ * coarse table still gets a smooth ramp rather than a staircase. The first half of a table is
+ * the attack and the second half the decay, each read at its own increment, so the envelope slider still splits
+ * the grain into attack (duration * envelope) and decay ((1 - envelope) * duration) whatever the shape.
+ */
+
+# pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "config.h"
+
+enum WindowShape { TRIANGLE, HANN, GAUSSIAN, TUKEY, EXP_DECAY, NUM_WINDOWS }; // TRIANGLE is the original linear attack and decay
+
+struct WindowTables {
+  static const int RESOLUTIONS = 3;
+  static constexpr int SIZES[RESOLUTIONS] = {256, 1024, 4096};
+  std::vector<float> tables[NUM_WINDOWS][RESOLUTIONS];
+
+  static float shape(int s, double x) { // x in [0, 1], peak of 1 at x = 0.5, 0 at both ends
+    switch (s) {
+      case HANN: return 0.5 - 0.5 * cos(2 * M_PI * x);
+      case GAUSSIAN: {
+        const double edge = exp(-0.5 * (0.5 / 0.15) * (0.5 / 0.15));
+        return (exp(-0.5 * ((x - 0.5) / 0.15) * ((x - 0.5) / 0.15)) - edge) / (1 - edge);
+      }
+      case TUKEY: { // half of the window is flat, a quarter cosine taper at each end
+        const double d = std::min(x, 1 - x);
+        return (d >= 0.25) ? 1.0 : 0.5 - 0.5 * cos(M_PI * d / 0.25);
+      }
+      case EXP_DECAY: // quick rounded rise, then an exponential tail
+        if (x < 0.5) return sin(M_PI * x);
+        return (exp(-6 * (2 * x - 1)) - exp(-6.0)) / (1 - exp(-6.0));
+      default: return 1 - fabs(2 * x - 1);
+    }
+  }
+
+  WindowTables() {
+    for (int s = 0; s < NUM_WINDOWS; s++)
+      for (int r = 0; r < RESOLUTIONS; r++) {
+        const int size = SIZES[r];
+        tables[s][r].assign(size + 1, 0.0f); // one past the end, 0
+        for (int i = 0; i < size; i++) tables[s][r][i] = shape(s, (double)i / size);
+      }
+  }
+
+  // between the points either side of phase; tables have a point past the end, so phase can go up to size
+  static float at(const float* table, double phase) {
+    const int i = (int)phase;
+    const float f = (float)(phase - i);
+    return table[i] + f * (table[i + 1] - table[i]);
+  }
+
+  // the smallest table that still has a point every few samples of a window this long; read with at() in between
+  const float* get(int s, long samples, int& size) const {
+    int r = 0;
+    while (r < RESOLUTIONS - 1 && SIZES[r] * 4 < samples) r++;
+    size = SIZES[r];
+    return tables[std::clamp(s, 0, NUM_WINDOWS - 1)][r].data();
+  }
+
+  static const WindowTables& shared() {
+    static WindowTables t;
+    return t;
+  }
+};
+
+// one grain's envelope. Its length and the split between attack and decay are counted out in samples when it is
+// set, so a grain knows exactly when it ends and each block is filled a segment at a time without checking.
+struct Envelope {
+  const float* table = nullptr;
+  int size = 0;
+  long attack = 0, length = 0; // samples in the attack, and in the whole envelope
+  long position = 0; // samples played
+  double attackStep = 0, decayStep = 0; // table points per sample on either side of the peak
+  float peak = 0;
+  float value = 0; // the last value read, for the governor
+
+  void set(int shape, float attackSeconds, float decaySeconds, float peakValue, float rate = SAMPLE_RATE) {
+    attack = std::max(1L, lround(attackSeconds * rate));
+    const long decay = std::max(1L, lround(decaySeconds * rate));
+    length = attack + decay;
+    table = WindowTables::shared().get(shape, length, size);
+    attackStep = 0.5 * size / attack;
+    decayStep = 0.5 * size / decay; // the last sample stays a step short of the closing 0
+    position = 0;
+    peak = peakValue;
+    value = 0;
+  }
+
+  long remaining() const { return length - position; }
+  bool done() const { return position >= length; }
+
+  // the next n (no more than remaining()) values into out
+  void fill(float* out, int n) {
+    if (n <= 0) return;
+    int t = 0;
+    const int rising = (int)std::clamp(attack - position, 0L, (long)n);
+    const double a = position * attackStep;
+    for (; t < rising; t++) out[t] = peak * WindowTables::at(table, a + t * attackStep);
+    const double d = 0.5 * size + (position - attack) * decayStep; // where the decay is at sample 0 of this block
+    for (; t < n; t++) out[t] = peak * WindowTables::at(table, d + t * decayStep);
+    position += n;
+    value = out[n - 1];
+  }
+
+  float operator()() {
+    fill(&value, 1);
+    return value;
+  }
+};